@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "epd_driver.h"  // Definitions for screen width and height
+
+// All buffers of a wake are taken from one arena that is allocated once at
+// boot, so large buffers do not depend on the fragmentation of the heap.
+#ifndef ARENA_SIZE
+#ifdef BOARD_HAS_PSRAM
+// Retained framebuffer, a full screen rect and the decoder buffers
+#define ARENA_SIZE (EPD_WIDTH * EPD_HEIGHT + 256 * 1024)
+#else
+// Pipeline ring buffer, decoder buffers and the LZ4 window
+#define ARENA_SIZE (112 * 1024)
+#endif
+#endif
+
+#define ARENA_ALIGNMENT 8
+
+// Large buffers are placed in PSRAM if the board has it, otherwise they are
+// taken from the internal SRAM.
+inline void* heap_malloc(size_t size) {
+#ifdef BOARD_HAS_PSRAM
+  return ps_malloc(size);
+#else
+  return malloc(size);
+#endif
+}
+
+// Bump allocator with stack semantics. Buffers released in reverse order of
+// their allocation are reused right away, buffers released out of order once
+// all buffers above them are released. Requests that do not fit are served
+// from the heap. The arena is not thread-safe: only the task that processes
+// the response allocates and releases buffers, the pipeline and section worker
+// tasks work on buffers handed to them.
+class Arena {
+ private:
+  // Precedes every allocation in the arena
+  struct Block {
+    uint32_t previous;  // offset of the block below
+    uint32_t released;
+  };
+
+  static const uint32_t NO_BLOCK = 0xFFFFFFFF;
+
+  uint8_t* memory = NULL;
+  size_t capacity = 0;
+  size_t top = 0;
+  uint32_t last = NO_BLOCK;
+  size_t high_water_mark = 0;
+
+  Block* block(uint32_t offset) { return (Block*)(memory + offset); }
+
+ public:
+  bool begin(size_t size = ARENA_SIZE) {
+    if (memory == NULL) {
+      memory = (uint8_t*)heap_malloc(size);
+      capacity = memory != NULL ? size : 0;
+    }
+    return memory != NULL;
+  }
+
+  void* allocate(size_t size) {
+    size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (memory == NULL || top + sizeof(Block) + aligned > capacity) {
+      Serial.printf("Arena exhausted, %u bytes taken from the heap\n", size);
+      return heap_malloc(size);
+    }
+
+    Block* allocated = block(top);
+    allocated->previous = last;
+    allocated->released = 0;
+    last = top;
+    top += sizeof(Block) + aligned;
+    high_water_mark = max(high_water_mark, top);
+    return allocated + 1;
+  }
+
+  void release(void* pointer) {
+    uint8_t* data = (uint8_t*)pointer;
+    if (data < memory || data >= memory + capacity) {
+      free(pointer);
+      return;
+    }
+
+    ((Block*)data - 1)->released = 1;
+    while (last != NO_BLOCK && block(last)->released) {
+      top = last;
+      last = block(last)->previous;
+    }
+  }
+
+  size_t getHighWaterMark() { return high_water_mark; }
+
+  size_t getCapacity() { return capacity; }
+};
+
+Arena arena;
+
+// Must only be called from the task that processes the response, see Arena
+inline void* buffer_malloc(size_t size) { return arena.allocate(size); }
+
+inline void buffer_free(void* pointer) {
+  if (pointer != NULL) {
+    arena.release(pointer);
+  }
+}
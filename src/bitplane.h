@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bit plane layout of the rects of schema version 9. Each row is sent as four
+// planes of (width + 7) / 8 bytes, from the lowest to the highest bit of the
+// gray level. Within a plane the first pixel is stored in the lowest bit of a
+// byte. Dithered images look like noise in the low planes, but the high
+// planes compress very well.
+// The kernel interleaves one byte of every plane into a 32 bit word of eight
+// nibbles with a few shifts and masks, without lookup tables.
+
+#define BIT_PLANES 4
+
+// Moves bit i of the byte to bit 4 * i of the result
+inline uint32_t bitplane_spread(uint32_t byte) {
+  byte = (byte | byte << 12) & 0x000F000F;
+  byte = (byte | byte << 6) & 0x03030303;
+  return (byte | byte << 3) & 0x11111111;
+}
+
+// Number of bytes of one plane of a row with the given width
+inline uint32_t bitplane_row_size(int width) {
+  return ((uint32_t)width + 7) / 8;
+}
+
+// Interleaves the planes of a row into nibbles. dst must be word aligned and
+// have space for width / 2 bytes rounded up to full words.
+inline void bitplane_interleave_row(const uint8_t *src, uint32_t *dst,
+                                    int width) {
+  uint32_t plane_size = bitplane_row_size(width);
+  const uint8_t *plane0 = src;
+  const uint8_t *plane1 = plane0 + plane_size;
+  const uint8_t *plane2 = plane1 + plane_size;
+  const uint8_t *plane3 = plane2 + plane_size;
+  for (uint32_t i = 0; i < plane_size; i++) {
+    dst[i] = bitplane_spread(plane0[i]) | bitplane_spread(plane1[i]) << 1 |
+             bitplane_spread(plane2[i]) << 2 | bitplane_spread(plane3[i]) << 3;
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// Preset dictionaries for zlib streams with the FDICT flag, e.g. common frames,
+// icons or font strips. Each dictionary is a file in DICTIONARY_DIR on the
+// flash file system, named by its zlib dictionary id (the Adler-32 checksum of
+// the dictionary) in hex, e.g. /dict/1a2b3c4d. The ids are announced to the
+// server, which may then compress small payloads against them.
+#define DICTIONARY_DIR "/dict"
+#define DICTIONARY_MAX_COUNT 8
+
+class DictionaryStore {
+ private:
+  fs::FS *fs = NULL;
+  uint32_t ids[DICTIONARY_MAX_COUNT];
+  int count = 0;
+
+  static String path(uint32_t id) {
+    char name[sizeof(DICTIONARY_DIR) + 10];
+    snprintf(name, sizeof(name), DICTIONARY_DIR "/%08x", id);
+    return String(name);
+  }
+
+ public:
+  // Lists the dictionaries on the file system, their content is only read
+  // when a payload references them
+  void begin(fs::FS &file_system) {
+    fs = &file_system;
+    count = 0;
+    File dir = fs->open(DICTIONARY_DIR);
+    if (!dir || !dir.isDirectory()) {
+      return;
+    }
+
+    File file = dir.openNextFile();
+    while (file && count < DICTIONARY_MAX_COUNT) {
+      char *end;
+      const char *name = strrchr(file.name(), '/');
+      name = name != NULL ? name + 1 : file.name();
+      uint32_t id = strtoul(name, &end, 16);
+      if (!file.isDirectory() && *end == '\0' && end - name == 8) {
+        ids[count++] = id;
+      }
+      file = dir.openNextFile();
+    }
+  }
+
+  // Comma separated hex ids for the Accept-Dictionary header
+  String getIds() {
+    String result;
+    for (int i = 0; i < count; i++) {
+      char id[10];
+      snprintf(id, sizeof(id), i > 0 ? ",%08x" : "%08x", ids[i]);
+      result += id;
+    }
+    return result;
+  }
+
+  // Reads the dictionary into dst. Only its last size bytes are used by
+  // deflate if it is larger than the window.
+  size_t load(uint32_t id, uint8_t *dst, size_t size) {
+    if (fs == NULL) {
+      return 0;
+    }
+    File file = fs->open(path(id), FILE_READ);
+    if (!file) {
+      return 0;
+    }
+
+    if (file.size() > size) {
+      file.seek(file.size() - size);
+    }
+    size_t length = file.read(dst, size);
+    file.close();
+    return length;
+  }
+};
+
+DictionaryStore dictionaries;
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "allocation.h"
+#include "epd_driver.h"
+
+#define FRAMEBUFFER_SIZE (EPD_WIDTH * EPD_HEIGHT / 2)
+#define FRAMEBUFFER_ROW_SIZE (EPD_WIDTH / 2)
+#define FRAMEBUFFER_FILE "/framebuffer.bin"
+
+// Copy of the complete display content in PSRAM. Rects of a message are
+// composited into it and the changed region is drawn in a single pass. The
+// content is persisted in flash, so it survives deep sleep.
+class Framebuffer {
+ private:
+  uint8_t *buffer = NULL;
+
+  // True if the buffer matches what is currently shown on the display
+  bool retained = false;
+  bool modified = false;
+  uint32_t stored_image_id = 0;
+
+  // Rows replaced by full width rects and columns replaced by full height
+  // rects while not retained, each as one contiguous range
+  int covered_top = 0;
+  int covered_bottom = 0;
+  int covered_left = 0;
+  int covered_right = 0;
+
+  // Bounding box of all rects blitted since the last flush
+  int dirty_left = EPD_WIDTH;
+  int dirty_top = EPD_HEIGHT;
+  int dirty_right = 0;
+  int dirty_bottom = 0;
+
+  // Extends the range start to end by from to, if they touch
+  static void cover(int *start, int *end, int from, int to) {
+    if (*start >= *end) {
+      *start = from;
+      *end = to;
+    } else if (from <= *end && to >= *start) {
+      *start = min(*start, from);
+      *end = max(*end, to);
+    }
+  }
+
+  void markDirty(Rect_t area) {
+    dirty_left = min(dirty_left, area.x);
+    dirty_top = min(dirty_top, area.y);
+    dirty_right = max(dirty_right, area.x + area.width);
+    dirty_bottom = max(dirty_bottom, area.y + area.height);
+  }
+
+  // Writes the nibbles selected by mask, value must be zero outside of it
+  static inline void put(uint8_t *dst, uint8_t value, uint8_t mask,
+                         bool delta) {
+    *dst = delta ? *dst ^ value : (*dst & ~mask) | value;
+  }
+
+  // Nibbles of the byte that differ from the key level
+  static inline uint8_t opaque(uint8_t value, uint8_t key) {
+    uint8_t diff = value ^ (key * 0x11);
+    return ((diff & 0x0F) ? 0x0F : 0) | ((diff & 0xF0) ? 0xF0 : 0);
+  }
+
+  // Writes the nibbles of value selected by mask that are not transparent
+  static inline void putKeyed(uint8_t *dst, uint8_t value, uint8_t mask,
+                              uint8_t key) {
+    mask &= opaque(value, key);
+    *dst = (*dst & ~mask) | (value & mask);
+  }
+
+  // Copies a single row of pixels to the nibble position x of the framebuffer
+  // row, the source is shifted by one nibble if x is odd. Delta rows are
+  // XORed onto the current content instead of replacing it.
+  static void blitRow(uint8_t *row, int x, const uint8_t *src, int width,
+                      bool delta) {
+    uint8_t *dst = row + (x >> 1);
+    if ((x & 1) == 0) {
+      if (delta) {
+        for (int i = 0; i < width / 2; i++) {
+          dst[i] ^= src[i];
+        }
+      } else {
+        memcpy(dst, src, width / 2);
+      }
+      if (width & 1) {
+        put(dst + width / 2, src[width / 2] & 0x0F, 0x0F, delta);
+      }
+      return;
+    }
+
+    put(dst, src[0] << 4, 0xF0, delta);
+    for (int i = 0; i < (width - 1) / 2; i++) {
+      put(dst + i + 1, (src[i] >> 4) | (src[i + 1] << 4), 0xFF, delta);
+    }
+    if ((width & 1) == 0) {
+      put(dst + width / 2, src[width / 2 - 1] >> 4, 0x0F, delta);
+    }
+  }
+
+  // Same as blitRow(), but pixels of the key level keep the current content
+  static void blitRowKeyed(uint8_t *row, int x, const uint8_t *src, int width,
+                           uint8_t key) {
+    uint8_t *dst = row + (x >> 1);
+    if ((x & 1) == 0) {
+      for (int i = 0; i < width / 2; i++) {
+        putKeyed(dst + i, src[i], 0xFF, key);
+      }
+      if (width & 1) {
+        putKeyed(dst + width / 2, src[width / 2], 0x0F, key);
+      }
+      return;
+    }
+
+    putKeyed(dst, src[0] << 4, 0xF0, key);
+    for (int i = 0; i < (width - 1) / 2; i++) {
+      putKeyed(dst + i + 1, (src[i] >> 4) | (src[i + 1] << 4), 0xFF, key);
+    }
+    if ((width & 1) == 0) {
+      putKeyed(dst + width / 2, src[width / 2 - 1] >> 4, 0x0F, key);
+    }
+  }
+
+ public:
+  void begin() {
+    if (buffer == NULL) {
+      buffer = (uint8_t *)buffer_malloc(FRAMEBUFFER_SIZE);
+      memset(buffer, 0xFF, FRAMEBUFFER_SIZE);
+    }
+  }
+
+  bool isRetained() { return retained; }
+
+  // Copies the pixels of a rect into the framebuffer. Returns true if drawing
+  // is deferred to flush(), otherwise the caller must draw the rect itself
+  // since the rest of the display content is unknown. Delta rects must only
+  // be applied to a retained framebuffer.
+  bool blit(Rect_t area, const uint8_t *pixel, bool delta = false) {
+    uint32_t row_size = (uint32_t)area.width / 2;
+    for (int row = 0; row < area.height; row++) {
+      blitRow(area, row, pixel + row * row_size, delta);
+    }
+    return commit(area);
+  }
+
+  // Copies a single row of a rect, for decoders that hand out rows one by
+  // one. commit() must follow after the last row.
+  void blitRow(Rect_t area, int row, const uint8_t *pixel, bool delta) {
+    begin();
+    blitRow(buffer + (area.y + row) * FRAMEBUFFER_ROW_SIZE, area.x, pixel,
+            area.width, delta);
+  }
+
+  // Copies a single row of a rect with a transparent key level, only onto a
+  // retained framebuffer. commit() must follow after the last row.
+  void blitRowKeyed(Rect_t area, int row, const uint8_t *pixel, uint8_t key) {
+    blitRowKeyed(buffer + (area.y + row) * FRAMEBUFFER_ROW_SIZE, area.x, pixel,
+                 area.width, key);
+  }
+
+  // Full width rects are contiguous in the framebuffer, decoders may write
+  // their pixels there directly and then commit() them. Returns NULL for
+  // other rects.
+  uint8_t *getRows(Rect_t area) {
+    if (area.x != 0 || area.width != EPD_WIDTH) {
+      return NULL;
+    }
+    begin();
+    return buffer + area.y * FRAMEBUFFER_ROW_SIZE;
+  }
+
+  // Completes a rect written to the framebuffer, returns the same as blit()
+  bool commit(Rect_t area) {
+    modified = true;
+    if (retained) {
+      markDirty(area);
+      return true;
+    }
+
+    // Full screen images may be sent as bands, or as strips on a rotated
+    // display. The whole display content is known once they cover all rows
+    // or columns.
+    if (area.x == 0 && area.width == EPD_WIDTH) {
+      cover(&covered_top, &covered_bottom, area.y, area.y + area.height);
+    }
+    if (area.y == 0 && area.height == EPD_HEIGHT) {
+      cover(&covered_left, &covered_right, area.x, area.x + area.width);
+    }
+    retained = (covered_top == 0 && covered_bottom == EPD_HEIGHT) ||
+               (covered_left == 0 && covered_right == EPD_WIDTH);
+    return false;
+  }
+
+  // Draws the bounding box of all rects blitted since the last flush
+  void flush() {
+    if (dirty_left >= dirty_right || dirty_top >= dirty_bottom) {
+      return;
+    }
+
+    // Align the region to full bytes, so rows can be copied without shifting
+    int left = dirty_left & ~1;
+    int right = (dirty_right + 1) & ~1;
+    Rect_t area = {
+        .x = left,
+        .y = dirty_top,
+        .width = right - left,
+        .height = dirty_bottom - dirty_top,
+    };
+    Serial.printf("Flush framebuffer region x: %d, y: %d, w: %d, h: %d\n",
+                  area.x, area.y, area.width, area.height);
+
+    epd_clear_area(area);
+    if (area.width == EPD_WIDTH) {
+      epd_draw_image(area, buffer + area.y * FRAMEBUFFER_ROW_SIZE,
+                     BLACK_ON_WHITE);
+    } else {
+      uint32_t row_size = area.width / 2;
+      uint8_t *region = (uint8_t *)buffer_malloc(row_size * area.height);
+      for (int row = 0; row < area.height; row++) {
+        memcpy(region + row * row_size,
+               buffer + (area.y + row) * FRAMEBUFFER_ROW_SIZE + left / 2,
+               row_size);
+      }
+      epd_draw_image(area, region, BLACK_ON_WHITE);
+      buffer_free(region);
+    }
+
+    dirty_left = EPD_WIDTH;
+    dirty_top = EPD_HEIGHT;
+    dirty_right = 0;
+    dirty_bottom = 0;
+  }
+
+  // Restores the framebuffer of the previous wake. It is only used if it
+  // belongs to the image that is currently displayed.
+  bool load(fs::FS &fs, uint32_t image_id) {
+    begin();
+    retained = false;
+    modified = false;
+    covered_top = 0;
+    covered_bottom = 0;
+    covered_left = 0;
+    covered_right = 0;
+    if (image_id == 0) {
+      return false;
+    }
+
+    File file = fs.open(FRAMEBUFFER_FILE, FILE_READ);
+    if (!file) {
+      return false;
+    }
+
+    file.read((uint8_t *)&stored_image_id, sizeof(stored_image_id));
+    if (stored_image_id == image_id) {
+      retained = file.read(buffer, FRAMEBUFFER_SIZE) == FRAMEBUFFER_SIZE;
+    }
+    file.close();
+    return retained;
+  }
+
+  // Persists the framebuffer if it matches the display content. If only the
+  // image id changed, just the header of the file is rewritten.
+  bool save(fs::FS &fs, uint32_t image_id) {
+    if (!retained || (!modified && stored_image_id == image_id)) {
+      return false;
+    }
+
+    File file = fs.open(FRAMEBUFFER_FILE, modified ? FILE_WRITE : "r+");
+    if (!file) {
+      return false;
+    }
+
+    file.write((uint8_t *)&image_id, sizeof(image_id));
+    if (modified) {
+      file.write(buffer, FRAMEBUFFER_SIZE);
+    }
+    file.close();
+
+    stored_image_id = image_id;
+    modified = false;
+    return true;
+  }
+};
+
+Framebuffer framebuffer;
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// CCITT Group 4 (ITU-T T.6) decoder for the bilevel rects of schema version
+// 10. Every line is coded as the positions where the color changes, relative
+// to the changes of the line above, so text pages shrink to a few KB. Bits are
+// read from the most significant bit of a byte first, as in TIFF files. White
+// pixels become 0xF, black pixels 0x0.
+
+#define G4_INPUT_SIZE 64
+#define G4_LOOKUP_BITS 8  // longer codes are searched in the code table
+
+struct g4_code_t {
+  uint16_t code;
+  uint8_t length;
+  uint16_t run;
+};
+
+// Run length codes of T.4, terminating codes (0 to 63) first, then the make
+// up codes for multiples of 64
+static const g4_code_t G4_WHITE_CODES[] = {
+    {0x35, 8, 0},     {0x07, 6, 1},     {0x07, 4, 2},     {0x08, 4, 3},
+    {0x0B, 4, 4},     {0x0C, 4, 5},     {0x0E, 4, 6},     {0x0F, 4, 7},
+    {0x13, 5, 8},     {0x14, 5, 9},     {0x07, 5, 10},    {0x08, 5, 11},
+    {0x08, 6, 12},    {0x03, 6, 13},    {0x34, 6, 14},    {0x35, 6, 15},
+    {0x2A, 6, 16},    {0x2B, 6, 17},    {0x27, 7, 18},    {0x0C, 7, 19},
+    {0x08, 7, 20},    {0x17, 7, 21},    {0x03, 7, 22},    {0x04, 7, 23},
+    {0x28, 7, 24},    {0x2B, 7, 25},    {0x13, 7, 26},    {0x24, 7, 27},
+    {0x18, 7, 28},    {0x02, 8, 29},    {0x03, 8, 30},    {0x1A, 8, 31},
+    {0x1B, 8, 32},    {0x12, 8, 33},    {0x13, 8, 34},    {0x14, 8, 35},
+    {0x15, 8, 36},    {0x16, 8, 37},    {0x17, 8, 38},    {0x28, 8, 39},
+    {0x29, 8, 40},    {0x2A, 8, 41},    {0x2B, 8, 42},    {0x2C, 8, 43},
+    {0x2D, 8, 44},    {0x04, 8, 45},    {0x05, 8, 46},    {0x0A, 8, 47},
+    {0x0B, 8, 48},    {0x52, 8, 49},    {0x53, 8, 50},    {0x54, 8, 51},
+    {0x55, 8, 52},    {0x24, 8, 53},    {0x25, 8, 54},    {0x58, 8, 55},
+    {0x59, 8, 56},    {0x5A, 8, 57},    {0x5B, 8, 58},    {0x4A, 8, 59},
+    {0x4B, 8, 60},    {0x32, 8, 61},    {0x33, 8, 62},    {0x34, 8, 63},
+    {0x1B, 5, 64},    {0x12, 5, 128},   {0x17, 6, 192},   {0x37, 7, 256},
+    {0x36, 8, 320},   {0x37, 8, 384},   {0x64, 8, 448},   {0x65, 8, 512},
+    {0x68, 8, 576},   {0x67, 8, 640},   {0xCC, 9, 704},   {0xCD, 9, 768},
+    {0xD2, 9, 832},   {0xD3, 9, 896},   {0xD4, 9, 960},   {0xD5, 9, 1024},
+    {0xD6, 9, 1088},  {0xD7, 9, 1152},  {0xD8, 9, 1216},  {0xD9, 9, 1280},
+    {0xDA, 9, 1344},  {0xDB, 9, 1408},  {0x98, 9, 1472},  {0x99, 9, 1536},
+    {0x9A, 9, 1600},  {0x18, 6, 1664},  {0x9B, 9, 1728},
+};
+
+static const g4_code_t G4_BLACK_CODES[] = {
+    {0x37, 10, 0},    {0x02, 3, 1},     {0x03, 2, 2},     {0x02, 2, 3},
+    {0x03, 3, 4},     {0x03, 4, 5},     {0x02, 4, 6},     {0x03, 5, 7},
+    {0x05, 6, 8},     {0x04, 6, 9},     {0x04, 7, 10},    {0x05, 7, 11},
+    {0x07, 7, 12},    {0x04, 8, 13},    {0x07, 8, 14},    {0x18, 9, 15},
+    {0x17, 10, 16},   {0x18, 10, 17},   {0x08, 10, 18},   {0x67, 11, 19},
+    {0x68, 11, 20},   {0x6C, 11, 21},   {0x37, 11, 22},   {0x28, 11, 23},
+    {0x17, 11, 24},   {0x18, 11, 25},   {0xCA, 12, 26},   {0xCB, 12, 27},
+    {0xCC, 12, 28},   {0xCD, 12, 29},   {0x68, 12, 30},   {0x69, 12, 31},
+    {0x6A, 12, 32},   {0x6B, 12, 33},   {0xD2, 12, 34},   {0xD3, 12, 35},
+    {0xD4, 12, 36},   {0xD5, 12, 37},   {0xD6, 12, 38},   {0xD7, 12, 39},
+    {0x6C, 12, 40},   {0x6D, 12, 41},   {0xDA, 12, 42},   {0xDB, 12, 43},
+    {0x54, 12, 44},   {0x55, 12, 45},   {0x56, 12, 46},   {0x57, 12, 47},
+    {0x64, 12, 48},   {0x65, 12, 49},   {0x52, 12, 50},   {0x53, 12, 51},
+    {0x24, 12, 52},   {0x37, 12, 53},   {0x38, 12, 54},   {0x27, 12, 55},
+    {0x28, 12, 56},   {0x58, 12, 57},   {0x59, 12, 58},   {0x2B, 12, 59},
+    {0x2C, 12, 60},   {0x5A, 12, 61},   {0x66, 12, 62},   {0x67, 12, 63},
+    {0x0F, 10, 64},   {0xC8, 12, 128},  {0xC9, 12, 192},  {0x5B, 12, 256},
+    {0x33, 12, 320},  {0x34, 12, 384},  {0x35, 12, 448},  {0x6C, 13, 512},
+    {0x6D, 13, 576},  {0x4A, 13, 640},  {0x4B, 13, 704},  {0x4C, 13, 768},
+    {0x4D, 13, 832},  {0x72, 13, 896},  {0x73, 13, 960},  {0x74, 13, 1024},
+    {0x75, 13, 1088}, {0x76, 13, 1152}, {0x77, 13, 1216}, {0x52, 13, 1280},
+    {0x53, 13, 1344}, {0x54, 13, 1408}, {0x55, 13, 1472}, {0x5A, 13, 1536},
+    {0x5B, 13, 1600}, {0x64, 13, 1664}, {0x65, 13, 1728},
+};
+
+#define G4_CODE_COUNT 91  // per color, terminating and make up codes
+
+static_assert(sizeof(G4_WHITE_CODES) == G4_CODE_COUNT * sizeof(g4_code_t),
+              "white code table");
+static_assert(sizeof(G4_BLACK_CODES) == G4_CODE_COUNT * sizeof(g4_code_t),
+              "black code table");
+
+// Make up codes beyond 1728, shared by both colors
+static const g4_code_t G4_EXTENDED_CODES[] = {
+    {0x08, 11, 1792}, {0x0C, 11, 1856}, {0x0D, 11, 1920}, {0x12, 12, 1984},
+    {0x13, 12, 2048}, {0x14, 12, 2112}, {0x15, 12, 2176}, {0x16, 12, 2240},
+    {0x17, 12, 2304}, {0x1C, 12, 2368}, {0x1D, 12, 2432}, {0x1E, 12, 2496},
+    {0x1F, 12, 2560},
+};
+
+typedef enum {
+  G4_MODE_PASS,
+  G4_MODE_HORIZONTAL,
+  G4_MODE_VERTICAL,
+  G4_MODE_INVALID,
+} g4_mode_t;
+
+// Number of entries of a change buffer for lines of the given width
+inline size_t g4_changes_size(int width) { return width + 4; }
+
+// Writes a line given by its changes as nibbles, starting with white
+inline void g4_render_line(const uint16_t *changes, int count, int width,
+                           uint8_t *dst) {
+  int start = 0;
+  for (int i = 0; i <= count; i++) {
+    int end = i < count ? changes[i] : width;
+    uint8_t value = i % 2 ? 0x00 : 0xFF;
+    if (start & 1 && start < end) {
+      dst[start / 2] = (dst[start / 2] & 0x0F) | (value & 0xF0);
+      start++;
+    }
+    int bytes = (end - start) / 2;
+    memset(dst + start / 2, value, bytes);
+    start += bytes * 2;
+    if (start < end) {
+      dst[start / 2] = value & 0x0F;
+      start++;
+    }
+  }
+}
+
+class G4Decoder {
+ private:
+  // Bits not consumed yet, aligned to the most significant bit
+  uint32_t bits = 0;
+  int bit_count = 0;
+  uint8_t input[G4_INPUT_SIZE];
+  size_t input_offset = 0;
+  size_t input_size = 0;
+
+  int width = 0;
+  uint16_t *reference = NULL;
+  uint16_t *current = NULL;
+  int reference_count = 0;
+  int current_count = 0;
+
+  void refill() {
+    while (bit_count <= 24) {
+      if (input_offset == input_size) {
+        input_offset = 0;
+        input_size = fill(input, G4_INPUT_SIZE);
+        if (input_size == 0) {
+          return;  // missing bits read as zeros, which is no valid code
+        }
+      }
+      bits |= (uint32_t)input[input_offset++] << (24 - bit_count);
+      bit_count += 8;
+    }
+  }
+
+  uint32_t peek(int count) {
+    refill();
+    return bits >> (32 - count);
+  }
+
+  void consume(int count) {
+    bits <<= count;
+    bit_count = bit_count > count ? bit_count - count : 0;
+  }
+
+  // Lookup tables of the codes up to G4_LOOKUP_BITS long, indexed with the
+  // next bits. Each entry holds the code length in the top 4 bits and the
+  // index into the code table, 0 for longer codes.
+  static const uint16_t *lookupTable(bool black) {
+    static uint16_t tables[2][1 << G4_LOOKUP_BITS];
+    static bool built = false;
+    if (!built) {
+      for (int color = 0; color < 2; color++) {
+        const g4_code_t *codes = color ? G4_BLACK_CODES : G4_WHITE_CODES;
+        for (int i = 0; i < G4_CODE_COUNT; i++) {
+          int length = codes[i].length;
+          if (length > G4_LOOKUP_BITS) {
+            continue;
+          }
+          int shift = G4_LOOKUP_BITS - length;
+          for (int fill = 0; fill < (1 << shift); fill++) {
+            tables[color][codes[i].code << shift | fill] = length << 12 | i;
+          }
+        }
+      }
+      built = true;
+    }
+    return tables[black];
+  }
+
+  static bool matches(const g4_code_t &code, uint32_t next) {
+    return next >> (13 - code.length) == code.code;
+  }
+
+  // Reads one run length code. Returns -1 for invalid codes.
+  int readCode(bool black) {
+    const g4_code_t *codes = black ? G4_BLACK_CODES : G4_WHITE_CODES;
+    uint16_t entry = lookupTable(black)[peek(G4_LOOKUP_BITS)];
+    if (entry != 0) {
+      consume(entry >> 12);
+      return codes[entry & 0x0FFF].run;
+    }
+
+    uint32_t next = peek(13);
+    for (int i = 0; i < G4_CODE_COUNT; i++) {
+      if (codes[i].length > G4_LOOKUP_BITS && matches(codes[i], next)) {
+        consume(codes[i].length);
+        return codes[i].run;
+      }
+    }
+    for (const g4_code_t &code : G4_EXTENDED_CODES) {
+      if (matches(code, next)) {
+        consume(code.length);
+        return code.run;
+      }
+    }
+    return -1;
+  }
+
+  // Reads codes up to the terminating code of a run
+  int readRun(bool black) {
+    int run = 0;
+    while (true) {
+      int code = readCode(black);
+      if (code < 0) {
+        return -1;
+      }
+      run += code;
+      if (code < 64) {
+        return run;
+      }
+    }
+  }
+
+  g4_mode_t readMode(int *offset) {
+    uint32_t next = peek(7);
+    if (next & 0x40) {
+      consume(1);
+      *offset = 0;
+      return G4_MODE_VERTICAL;
+    }
+    switch (next >> 4) {
+      case 0x3:  // 011
+      case 0x2:  // 010
+        consume(3);
+        *offset = next >> 4 == 0x3 ? 1 : -1;
+        return G4_MODE_VERTICAL;
+      case 0x1:  // 001
+        consume(3);
+        return G4_MODE_HORIZONTAL;
+    }
+    if (next >> 3 == 0x1) {  // 0001
+      consume(4);
+      return G4_MODE_PASS;
+    }
+    switch (next >> 1) {
+      case 0x3:  // 000011
+      case 0x2:  // 000010
+        consume(6);
+        *offset = next >> 1 == 0x3 ? 2 : -2;
+        return G4_MODE_VERTICAL;
+    }
+    switch (next) {
+      case 0x3:  // 0000011
+      case 0x2:  // 0000010
+        consume(7);
+        *offset = next == 0x3 ? 3 : -3;
+        return G4_MODE_VERTICAL;
+    }
+    return G4_MODE_INVALID;
+  }
+
+  // Two changes at the same position cancel each other
+  void addChange(int position) {
+    if (position >= width) {
+      return;
+    } else if (current_count > 0 && position == current[current_count - 1]) {
+      current_count--;
+    } else {
+      current[current_count++] = position;
+    }
+  }
+
+ protected:
+  // Supplies the next bytes of the coded data, returns 0 at its end
+  virtual size_t fill(uint8_t *buffer, size_t size) = 0;
+
+ public:
+  virtual ~G4Decoder() {}
+
+  // Starts an image. The buffers hold g4_changes_size(width) entries each.
+  void begin(int line_width, uint16_t *reference_buffer,
+             uint16_t *current_buffer) {
+    width = line_width;
+    reference = reference_buffer;
+    current = current_buffer;
+    // The line above the first one is white
+    reference_count = 0;
+    current_count = 0;
+  }
+
+  // Decodes the next line. Returns false if the coded data is invalid.
+  bool decodeLine() {
+    // Two changes beyond the line keep b1 and b2 valid at its end
+    for (int i = 0; i < 3; i++) {
+      reference[reference_count + i] = width;
+    }
+
+    current_count = 0;
+    int a0 = -1;
+    bool black = false;
+    int k = 0;
+    while (a0 < width) {
+      // b1 is the first change right of a0 to the opposite color of a0,
+      // changes to black have even indices
+      while (k > 0 && reference[k - 1] > a0) {
+        k--;
+      }
+      while (reference[k] <= a0 || (k & 1) != black) {
+        k++;
+      }
+      int b1 = reference[k];
+      int b2 = reference[k + 1];
+
+      int offset = 0;
+      switch (readMode(&offset)) {
+        case G4_MODE_PASS:
+          a0 = b2;
+          break;
+
+        case G4_MODE_HORIZONTAL: {
+          int run1 = readRun(black);
+          int run2 = run1 >= 0 ? readRun(!black) : -1;
+          if (run2 < 0) {
+            return false;
+          }
+          int a1 = (a0 > 0 ? a0 : 0) + run1;
+          int a2 = a1 + run2;
+          if (a2 > width) {
+            return false;
+          }
+          addChange(a1);
+          addChange(a2);
+          a0 = a2;
+          break;
+        }
+
+        case G4_MODE_VERTICAL: {
+          int a1 = b1 + offset;
+          if (a1 < 0 || a1 > width || a1 <= a0) {
+            return false;
+          }
+          addChange(a1);
+          a0 = a1;
+          black = !black;
+          break;
+        }
+
+        default:
+          return false;
+      }
+    }
+
+    uint16_t *decoded = current;
+    current = reference;
+    reference = decoded;
+    reference_count = current_count;
+    return true;
+  }
+
+  // Changes of the last decoded line
+  const uint16_t *getChanges() { return reference; }
+
+  int getChangeCount() { return reference_count; }
+};
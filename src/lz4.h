@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// LZ4 frame format of schema version 7, as written by the lz4 command line
+// tool or any LZ4 library. A frame consists of a header, blocks that each
+// start with a 32 bit size and an end mark. Compressed blocks are sequences
+// of a token, literals and a match within the last 64 KB of output.
+// Dictionary ids are not supported, checksums are skipped.
+
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_WINDOW_SIZE 65536  // largest match offset + 1
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_FRAME_HEADER_SIZE 15
+
+// Flags of the frame descriptor
+#define LZ4_FLAG_VERSION_MASK 0xC0
+#define LZ4_FLAG_VERSION 0x40
+#define LZ4_FLAG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLAG_CONTENT_SIZE 0x08
+#define LZ4_FLAG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLAG_DICTIONARY_ID 0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000
+
+inline uint32_t lz4_read_uint32(const uint8_t *src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+// Parses the frame header at src. Returns its size, 0 if more bytes are
+// needed or -1 if it is no supported LZ4 frame.
+inline int lz4_read_frame_header(const uint8_t *src, size_t length,
+                                 uint8_t *flags) {
+  if (length < 7) {
+    return 0;
+  }
+  if (lz4_read_uint32(src) != LZ4_MAGIC ||
+      (src[4] & LZ4_FLAG_VERSION_MASK) != LZ4_FLAG_VERSION ||
+      (src[4] & LZ4_FLAG_DICTIONARY_ID)) {
+    return -1;
+  }
+
+  *flags = src[4];
+  int size = 7 + (*flags & LZ4_FLAG_CONTENT_SIZE ? 8 : 0);
+  return length < (size_t)size ? 0 : size;
+}
+
+// Decodes a complete frame into dst. Returns the decoded size or 0 if the
+// frame is invalid or does not fit.
+inline size_t lz4_decode(const uint8_t *src, size_t src_length, uint8_t *dst,
+                         size_t dst_length) {
+  uint8_t flags;
+  int header_size = lz4_read_frame_header(src, src_length, &flags);
+  if (header_size <= 0) {
+    return 0;
+  }
+
+  const uint8_t *in = src + header_size;
+  const uint8_t *in_end = src + src_length;
+  uint8_t *out = dst;
+  uint8_t *out_end = dst + dst_length;
+  while (in + 4 <= in_end) {
+    uint32_t block_size = lz4_read_uint32(in);
+    in += 4;
+    if (block_size == 0) {
+      return out - dst;
+    }
+
+    if (block_size & LZ4_BLOCK_UNCOMPRESSED) {
+      block_size &= ~LZ4_BLOCK_UNCOMPRESSED;
+      if (block_size > (size_t)(in_end - in) ||
+          block_size > (size_t)(out_end - out)) {
+        return 0;
+      }
+      memcpy(out, in, block_size);
+      out += block_size;
+      in += block_size;
+    } else {
+      if (block_size > (size_t)(in_end - in)) {
+        return 0;
+      }
+      const uint8_t *block_end = in + block_size;
+      while (in < block_end) {
+        uint8_t token = *in++;
+        size_t literal = token >> 4;
+        if (literal == 15) {
+          uint8_t extra;
+          do {
+            if (in >= block_end) {
+              return 0;
+            }
+            extra = *in++;
+            literal += extra;
+          } while (extra == 255);
+        }
+        if (literal > (size_t)(block_end - in) ||
+            literal > (size_t)(out_end - out)) {
+          return 0;
+        }
+        memcpy(out, in, literal);
+        out += literal;
+        in += literal;
+        if (in == block_end) {
+          break;  // the last sequence has no match
+        }
+
+        if (in + 2 > block_end) {
+          return 0;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match = (token & 0x0F) + LZ4_MIN_MATCH;
+        if (match == 15 + LZ4_MIN_MATCH) {
+          uint8_t extra;
+          do {
+            if (in >= block_end) {
+              return 0;
+            }
+            extra = *in++;
+            match += extra;
+          } while (extra == 255);
+        }
+        if (offset == 0 || offset > (size_t)(out - dst) ||
+            match > (size_t)(out_end - out)) {
+          return 0;
+        }
+
+        const uint8_t *from = out - offset;
+        if (offset >= match) {
+          memcpy(out, from, match);
+          out += match;
+        } else {
+          // Overlapping match repeats the last offset bytes
+          for (size_t i = 0; i < match; i++) {
+            *out++ = *from++;
+          }
+        }
+      }
+    }
+
+    if (flags & LZ4_FLAG_BLOCK_CHECKSUM) {
+      in += 4;
+    }
+  }
+  return 0;
+}
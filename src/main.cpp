@@ -1,17 +1,16 @@
-#ifndef BOARD_HAS_PSRAM
-#error "Please enable PSRAM !!!"
-#endif
-
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <FFat.h>
 #include <Preferences.h>
 
 #include "epaper_config.h"
 #include "epd_driver.h"
+#include "dictionaries.h"
 #include "esp_adc_cal.h"
 #include "network.hpp"
 #include "opensans16.h"
 #include "pins.h"
+#include "pipeline.h"
 #include "response_parser.h"
 #include "screen_io.h"
 #include "status_code_counter.hpp"
@@ -19,6 +18,9 @@
 #define FILE_SYSTEM FFat
 #define DBG_OUTPUT_PORT Serial
 #define STATUS_CODE_HISTORY 5
+// Recorded in the status code history minus the st_status of the stream if a
+// download was aborted, below the negative error codes of HTTPClient
+#define STATUS_DOWNLOAD_ABORTED -100
 
 extern const uint8_t rootca_crt_bundle_start[] asm(
     "_binary_data_cert_x509_crt_bundle_bin_start");
@@ -45,13 +47,34 @@ float read_battery() {
   return ((float)v / 4095.0) * 2.0 * 3.3 * (vref / 1000.0);
 }
 
-net_state_t request_device_image(uint32_t *imageId, uint32_t *sleepTime) {
-  NetworkClient client;
-  client.addImageIdHeader(image_id);
-  client.addAcceptVersionHeader(SUPPORTED_VERSIONS);
+void add_image_request_headers(NetworkClient &client, uint32_t imageId,
+                               String versions) {
+  client.addImageIdHeader(imageId);
+  client.addAcceptVersionHeader(versions);
+  client.addAcceptDictionaryHeader(dictionaries.getIds());
+  client.addAcceptChecksumHeader();
+  client.addAcceptEncodingHeader();
+  if (DISPLAY_TRANSFORM != TRANSFORM_NONE) {
+    client.addOrientationHeader(transform_degrees(DISPLAY_TRANSFORM),
+                                transform_is_mirrored(DISPLAY_TRANSFORM));
+  }
   client.addVoltageHeader(current_voltage);
   client.addWakeupCountHeader(wakeup_count);
   client.addAuthorizationHeader(device_token);
+}
+
+net_state_t request_device_image(uint32_t *imageId, uint32_t *sleepTime) {
+#ifdef BOARD_HAS_PSRAM
+  // Rects are composited onto the image of the previous wake
+  framebuffer.load(FILE_SYSTEM, *imageId);
+#endif
+
+  // Parsing the body changes the image id and the supported versions, resumed
+  // requests must still send the ones the body was generated for
+  uint32_t requestedImageId = *imageId;
+  String versions = supported_versions();
+  NetworkClient client;
+  add_image_request_headers(client, requestedImageId, versions);
 
   int httpCode = client.GET(server_url);
 
@@ -65,9 +88,71 @@ net_state_t request_device_image(uint32_t *imageId, uint32_t *sleepTime) {
     size_t response_length = client.getSize();
     write_text("Got response with content length: " + String(response_length));
 
-    HttpStream stream(responseStream, response_length);
-    net_state_t response = process_stream(&stream, imageId, sleepTime);
+    bool checksum = client.getHeader("Checksum").equals("adler32");
+    String etag = client.getHeader("ETag");
+    String encoding = client.getHeader("Content-Encoding");
+
+    // If the connection drops, the rest of the body is requested within this
+    // wake instead of downloading everything again on the next one. With the
+    // pipeline, this runs on its network task.
+    reopen_function_t reopen = NULL;
+    if (checksum || etag.length() > 0) {
+      reopen = [&](size_t offset) -> Stream * {
+        add_image_request_headers(client, requestedImageId, versions);
+        client.addRangeHeader(offset, etag);
+        int resumeCode = client.GET(server_url);
+        String range = client.getHeader("Content-Range");
+        if (resumeCode != 206 ||
+            !range.startsWith("bytes " + String(offset) + "-")) {
+          DBG_OUTPUT_PORT.printf("Could not resume download: %d %s\n",
+                                 resumeCode, range.c_str());
+          return NULL;
+        }
+        return client.getStreamPtr();
+      };
+    }
+
+    HttpStream stream(responseStream, response_length, reopen);
+    if (client.getHeader("Transfer-Encoding").equalsIgnoreCase("chunked")) {
+      // The stream of the client still contains the chunk framing
+      stream.enableChunkedTransfer();
+    }
+    if (checksum) {
+      stream.enableChecksum();
+    }
+
+    // The image id and sleep time of the body are only taken over once the
+    // image arrived intact, otherwise the next request asks for a full image
+    uint32_t receivedImageId = 0;
+    uint32_t receivedSleepTime = 0;
+#if PIPELINE_ENABLED
+    net_state_t response;
+    {
+      // Download on the network core while this task decodes and draws. The
+      // network task is stopped when the pipeline goes out of scope.
+      PipelineStream pipeline(&stream);
+      response = process_response(&pipeline, encoding, &receivedImageId,
+                                  &receivedSleepTime);
+    }
+#else
+    net_state_t response = process_response(&stream, encoding, &receivedImageId,
+                                            &receivedSleepTime);
+#endif
     epd_poweroff();
+
+    if (stream.getStatus() > ST_STREAM_END_UNEXPECTED) {
+      // Record why the download was aborted, e.g. a stalled or too slow
+      // connection
+      status_codes.add(STATUS_DOWNLOAD_ABORTED - stream.getStatus());
+    }
+
+    if (response == SUCCESS) {
+      *imageId = receivedImageId;
+      *sleepTime = receivedSleepTime;
+#ifdef BOARD_HAS_PSRAM
+      framebuffer.save(FILE_SYSTEM, *imageId);
+#endif
+    }
     return response;
   } else {
     if (httpCode < 0) {
@@ -81,6 +166,8 @@ net_state_t request_device_image(uint32_t *imageId, uint32_t *sleepTime) {
 }
 
 net_state_t request_device_token(Preferences preferences) {
+  // The display is cleared, so the server must send the full image next time
+  image_id = 0;
   print_on_display = true;
   epd_clear();
   reset_text_cursor();
@@ -147,8 +234,18 @@ void setup() {
 
   wakeup_count++;
 
+  // Reserve the buffers of this wake before anything fragments the heap
+  if (!arena.begin()) {
+    DBG_OUTPUT_PORT.println("Could not allocate the buffer arena");
+  }
+
   epd_init();
   current_voltage = read_battery();
+  FILE_SYSTEM.begin(true);
+  dictionaries.begin(FILE_SYSTEM);
+  inflate_dictionary_loader = [](uint32_t id, uint8_t *dst, size_t size) {
+    return dictionaries.load(id, dst, size);
+  };
 
   if (!is_wakeup_from_deepsleep) {
     // We do not want to print anything on the display when leaving deepsleep so
@@ -205,6 +302,9 @@ void setup() {
     sleep_time_in_s = get_sleep_time_for_error();
   }
 
+  DBG_OUTPUT_PORT.printf("Arena high-water mark: %u of %u bytes\n",
+                         arena.getHighWaterMark(), arena.getCapacity());
+
   NetworkClient::stopWifi();
   Serial.end();
   esp_sleep_enable_timer_wakeup(1000000ULL * sleep_time_in_s);
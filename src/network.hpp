@@ -5,6 +5,13 @@
 #include <WiFiClient.h>
 #include <WiFiClientSecure.h>
 
+// Lets the server compress the body with gzip or deflate. HTTPClient sends its
+// own "Accept-Encoding: identity" with HTTP/1.1 requests, so the image is then
+// requested with HTTP/1.0 and the server cannot use chunked transfer encoding.
+#ifndef HTTP_ACCEPT_ENCODING
+#define HTTP_ACCEPT_ENCODING 0
+#endif
+
 extern const uint8_t rootca_crt_bundle_start[] asm(
     "_binary_data_cert_x509_crt_bundle_bin_start");
 
@@ -37,11 +44,16 @@ class NetworkClient {
     addDeviceIdHeader();
 
     http.begin(client, url);
+    const char *headers[] = {"ETag", "Content-Range", "Checksum",
+                             "Transfer-Encoding", "Content-Encoding"};
+    http.collectHeaders(headers, 5);
     return http.GET();
   }
 
   String getString() { return http.getString(); }
 
+  String getHeader(const char *name) { return http.header(name); }
+
   WiFiClient *getStreamPtr() { return http.getStreamPtr(); }
 
   int getSize() { return http.getSize(); }
@@ -66,7 +78,7 @@ class NetworkClient {
     http.addHeader("Wifi-Signal", String(WiFi.RSSI()));
   }
 
-  void addImageIdHeader(uint8_t image_id) {
+  void addImageIdHeader(uint32_t image_id) {
     http.addHeader("Image-Id", String(image_id));
   }
 
@@ -74,6 +86,41 @@ class NetworkClient {
     http.addHeader("Accept-Version", versions);
   }
 
+  // Preset dictionaries the server may compress against, see dictionaries.h
+  void addAcceptDictionaryHeader(String ids) {
+    if (ids.length() > 0) {
+      http.addHeader("Accept-Dictionary", ids);
+    }
+  }
+
+  void addAcceptChecksumHeader() {
+    http.addHeader("Accept-Checksum", "adler32");
+  }
+
+  // Orientation the panel is viewed in, rects are rendered for it and
+  // rotated on the device
+  void addOrientationHeader(int degrees, bool mirrored) {
+    http.addHeader("Orientation",
+                   String(degrees) + (mirrored ? " mirrored" : ""));
+  }
+
+  // The body is decoded by the firmware, HTTPClient leaves it untouched
+  void addAcceptEncodingHeader() {
+#if HTTP_ACCEPT_ENCODING
+    http.useHTTP10(true);
+    http.addHeader("Accept-Encoding", "gzip, deflate");
+#endif
+  }
+
+  // Requests the rest of the body from offset on, but only if it did not
+  // change since the first response
+  void addRangeHeader(size_t offset, String etag) {
+    http.addHeader("Range", "bytes=" + String(offset) + "-");
+    if (etag.length() > 0) {
+      http.addHeader("If-Range", etag);
+    }
+  }
+
   String errorToString(int statusCode) {
     if (statusCode < 0) {
       return http.errorToString(statusCode);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Expands rows of palette indices with 1, 2 or 4 bits per pixel into the 4 bit
+// gray levels of the display. The first pixel is stored in the lowest bits of
+// a byte, the same as for the nibbles of schema version 1. Each input byte is
+// translated with a lookup table and the result is written as 32 bit words.
+
+#define PALETTE_MAX_SIZE 16
+
+class PaletteExpander {
+ private:
+  uint32_t lut[256];
+  int bpp = 4;
+
+ public:
+  // Builds the lookup table for the given palette. Without a palette the gray
+  // levels are evenly spaced between black (0x0) and white (0xF). Indices
+  // beyond the palette are white.
+  void init(int bits_per_pixel, const uint8_t *palette, int palette_size) {
+    bpp = bits_per_pixel;
+    int levels = 1 << bpp;
+    uint8_t colors[PALETTE_MAX_SIZE];
+    for (int i = 0; i < levels; i++) {
+      if (palette_size == 0) {
+        colors[i] = i * 15 / (levels - 1);
+      } else {
+        colors[i] = i < palette_size ? palette[i] & 0x0F : 0x0F;
+      }
+    }
+
+    int pixels = 8 / bpp;
+    for (int byte = 0; byte < 256; byte++) {
+      uint32_t value = 0;
+      for (int pixel = 0; pixel < pixels; pixel++) {
+        uint8_t index = (byte >> (pixel * bpp)) & (levels - 1);
+        value |= (uint32_t)colors[index] << (pixel * 4);
+      }
+      lut[byte] = value;
+    }
+  }
+
+  // Number of packed bytes of a row with the given width
+  uint32_t packedRowSize(int width) { return ((uint32_t)width * bpp + 7) / 8; }
+
+  // Expands a row of packed indices into dst, which must be word aligned and
+  // have space for width / 2 bytes rounded up to full words. src must be
+  // readable for 3 bytes beyond the packed row.
+  void expandRow(const uint8_t *src, uint32_t *dst, int width) {
+    int words = (width / 2 + 3) / 4;
+    switch (bpp) {
+      case 1:
+        // One byte holds eight pixels, which is exactly one word
+        for (int i = 0; i < words; i++) {
+          dst[i] = lut[src[i]];
+        }
+        break;
+      case 2:
+        for (int i = 0; i < words; i++) {
+          dst[i] = lut[src[2 * i]] | lut[src[2 * i + 1]] << 16;
+        }
+        break;
+      default:
+        for (int i = 0; i < words; i++) {
+          dst[i] = lut[src[4 * i]] | lut[src[4 * i + 1]] << 8 |
+                   lut[src[4 * i + 2]] << 16 | lut[src[4 * i + 3]] << 24;
+        }
+        break;
+    }
+  }
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#include "allocation.h"
+#include "stream.cpp"
+
+// The pipeline downloads the response on a separate task while the calling
+// task decodes and draws the data that already arrived. Can be disabled with
+// -DPIPELINE_ENABLED=0 to process the response sequentially.
+#ifndef PIPELINE_ENABLED
+#define PIPELINE_ENABLED 1
+#endif
+
+#define PIPELINE_BUFFER_SIZE 1024 * 32  // must be a power of two
+#define PIPELINE_READ_SIZE 4096
+#define PIPELINE_NETWORK_CORE 0
+// A dropped download is resumed on the network task, including the TLS
+// handshake of the new request
+#define PIPELINE_TASK_STACK_SIZE 16384
+
+// Lock-free ring buffer for exactly one producer and one consumer task. Both
+// sides work directly on contiguous regions of the buffer, so no data needs to
+// be copied into temporary buffers.
+class RingBuffer {
+ private:
+  uint8_t* buffer;
+  size_t capacity;
+  std::atomic<size_t> head{0};  // total bytes written, owned by the producer
+  std::atomic<size_t> tail{0};  // total bytes read, owned by the consumer
+
+ public:
+  RingBuffer(size_t capacity) : capacity(capacity) {
+    buffer = (uint8_t*)buffer_malloc(capacity);
+  }
+
+  ~RingBuffer() { buffer_free(buffer); }
+
+  // Returns the length of the free region starting at *region
+  size_t writeRegion(uint8_t** region) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t used = h - tail.load(std::memory_order_acquire);
+    size_t offset = h & (capacity - 1);
+    *region = buffer + offset;
+    return min(capacity - used, capacity - offset);
+  }
+
+  void commit(size_t length) {
+    head.store(head.load(std::memory_order_relaxed) + length,
+               std::memory_order_release);
+  }
+
+  // Returns the length of the filled region starting at *region
+  size_t readRegion(const uint8_t** region) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t used = head.load(std::memory_order_acquire) - t;
+    size_t offset = t & (capacity - 1);
+    *region = buffer + offset;
+    return min(used, capacity - offset);
+  }
+
+  void consume(size_t length) {
+    tail.store(tail.load(std::memory_order_relaxed) + length,
+               std::memory_order_release);
+  }
+};
+
+// Consumer side of the pipeline. Creating the stream starts a network task
+// pinned to PIPELINE_NETWORK_CORE which reads the source into the ring buffer.
+// The Arduino loop task runs on the other core and decodes from this stream.
+// While the pipeline exists, the source belongs to the network task. This
+// includes the reopen callback of an HttpStream and the HTTP client it uses,
+// the calling task must not touch them until the pipeline is destroyed.
+class PipelineStream : public ResponseStream {
+ private:
+  ResponseStream* source;
+  RingBuffer ring;
+  TaskHandle_t consumer_task;
+  std::atomic<bool> source_finished{false};
+  std::atomic<bool> aborted{false};
+  std::atomic<bool> producer_finished{false};
+
+  // Set if the network task could not be created, the source is then read
+  // directly on the calling task
+  bool sequential = false;
+
+  // Borrowed bytes are only released to the producer on the next call
+  size_t borrowed = 0;
+
+  void releaseBorrowed() {
+    ring.consume(borrowed);
+    borrowed = 0;
+  }
+
+  // Waits for the next filled region, returns 0 at the end of the source
+  size_t nextRegion(const uint8_t** region) {
+    while (true) {
+      size_t available = ring.readRegion(region);
+      if (available > 0) {
+        return available;
+      } else if (source_finished) {
+        // Data may have been committed right before the flag was set
+        return ring.readRegion(region);
+      }
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+  }
+
+  static void networkTask(void* parameter) {
+    PipelineStream* pipeline = (PipelineStream*)parameter;
+    TaskHandle_t consumer_task = pipeline->consumer_task;
+    pipeline->produce();
+
+    // The pipeline may be released as soon as the flag is set
+    pipeline->producer_finished = true;
+    xTaskNotifyGive(consumer_task);
+    vTaskDelete(NULL);
+  }
+
+  void produce() {
+    while (!aborted) {
+      uint8_t* region;
+      size_t length =
+          min(ring.writeRegion(&region), (size_t)PIPELINE_READ_SIZE);
+      if (length == 0) {
+        // Wait until the consumer made some space
+        vTaskDelay(1);
+        continue;
+      }
+
+      long remaining = source->getExpectedRemainingSize();
+      if (remaining == 0) {
+        break;
+      } else if (remaining > 0 && remaining < (long)length) {
+        length = remaining;
+      }
+
+      size_t size = source->readBytes(region, length);
+      ring.commit(size);
+      xTaskNotifyGive(consumer_task);
+      if (size < length) {
+        break;
+      }
+    }
+
+    source_finished = true;
+  }
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    if (sequential) {
+      return source->readBytes(buffer, length);
+    }
+
+    releaseBorrowed();
+    size_t size = 0;
+    while (size < length) {
+      const uint8_t* region;
+      size_t available = nextRegion(&region);
+      if (available == 0) {
+        break;
+      }
+
+      size_t chunk = min(length - size, available);
+      memcpy(buffer + size, region, chunk);
+      ring.consume(chunk);
+      size += chunk;
+    }
+    return size;
+  }
+
+  size_t borrowRaw(const uint8_t** data, size_t length) {
+    if (sequential) {
+      return source->borrow(data, length);
+    }
+
+    releaseBorrowed();
+    borrowed = min(length, nextRegion(data));
+    return borrowed;
+  }
+
+ public:
+  PipelineStream(ResponseStream* source)
+      : source(source), ring(PIPELINE_BUFFER_SIZE) {
+    consumer_task = xTaskGetCurrentTaskHandle();
+    if (xTaskCreatePinnedToCore(networkTask, "network",
+                                PIPELINE_TASK_STACK_SIZE, this, 1, NULL,
+                                PIPELINE_NETWORK_CORE) != pdPASS) {
+      Serial.println("Could not create network task, reading sequentially");
+      sequential = true;
+      source_finished = true;
+      producer_finished = true;
+    }
+  }
+
+  bool canBorrow() { return !sequential || source->canBorrow(); }
+
+  st_status finish() {
+    // Let the network task read the rest of the body, the source must not be
+    // used by both tasks at once
+    releaseBorrowed();
+    while (!producer_finished) {
+      const uint8_t* region;
+      ring.consume(ring.readRegion(&region));
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+    return source->finish();
+  }
+
+  ~PipelineStream() {
+    // The network task works on this object, so it must be stopped before
+    // the memory is released
+    aborted = true;
+    while (!producer_finished) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+  }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Parts of the PNG format needed for the 4 bit grayscale rects of schema
+// version 8. The image data of a PNG is a zlib stream, split over the IDAT
+// chunks. Each row of the inflated data starts with a filter type byte, the
+// filters predict a byte from its left, upper and upper left neighbours. For
+// bit depths below 8 the neighbours are whole bytes, not pixels.
+
+#define PNG_SIGNATURE_SIZE 8
+#define PNG_CHUNK_HEADER_SIZE 8  // length and type
+#define PNG_CHUNK_CRC_SIZE 4
+#define PNG_IHDR_SIZE 13
+
+#define PNG_CHUNK_IHDR 0x49484452
+#define PNG_CHUNK_IDAT 0x49444154
+#define PNG_CHUNK_IEND 0x49454E44
+
+#define PNG_COLOR_TYPE_GRAY 0
+
+typedef enum {
+  PNG_FILTER_NONE = 0,
+  PNG_FILTER_SUB = 1,
+  PNG_FILTER_UP = 2,
+  PNG_FILTER_AVERAGE = 3,
+  PNG_FILTER_PAETH = 4,
+} png_filter_t;
+
+static const uint8_t PNG_SIGNATURE[PNG_SIGNATURE_SIZE] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+// Numbers in PNG files are big endian
+inline uint32_t png_read_uint32(const uint8_t *src) {
+  return ((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+// Chunks with an upper case first letter are required to display the image
+inline bool png_is_critical(uint32_t type) { return !(type & 0x20000000); }
+
+inline uint8_t png_paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = p > a ? p - a : a - p;
+  int pb = p > b ? p - b : b - p;
+  int pc = p > c ? p - c : c - p;
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+// Reverses the filter of a row in place. previous is the unfiltered row
+// above, all zero for the first row. Returns false for unknown filters.
+inline bool png_unfilter_row(uint8_t filter, uint8_t *row,
+                             const uint8_t *previous, size_t length) {
+  switch (filter) {
+    case PNG_FILTER_NONE:
+      return true;
+    case PNG_FILTER_SUB:
+      for (size_t i = 1; i < length; i++) {
+        row[i] += row[i - 1];
+      }
+      return true;
+    case PNG_FILTER_UP:
+      for (size_t i = 0; i < length; i++) {
+        row[i] += previous[i];
+      }
+      return true;
+    case PNG_FILTER_AVERAGE:
+      row[0] += previous[0] / 2;
+      for (size_t i = 1; i < length; i++) {
+        row[i] += (row[i - 1] + previous[i]) / 2;
+      }
+      return true;
+    case PNG_FILTER_PAETH:
+      row[0] += previous[0];
+      for (size_t i = 1; i < length; i++) {
+        row[i] += png_paeth(row[i - 1], previous[i], previous[i - 1]);
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+// PNG stores the first pixel of a byte in the high nibble, the display in
+// the low nibble
+inline void png_swap_nibbles(const uint8_t *src, uint8_t *dst,
+                             size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    dst[i] = (src[i] >> 4) | (src[i] << 4);
+  }
+}
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <Arduino.h>
+#include <miniz.h>
+
+#include "allocation.h"
+#include "bitplane.h"
+#include "epd_driver.h"
+#include "g4.h"
+#include "palette.h"
+#include "png.h"
+#include "rle.h"
+#include "scale.h"
+#include "stream.cpp"
+
+// Codecs of a single tile in a tiled rect, stored in the high nibble of the
+// first byte of each tile
+typedef enum {
+  TILE_SOLID = 0,    // low nibble is the gray level of the whole tile
+  TILE_RAW = 1,      // tile nibbles follow as they are
+  TILE_RLE = 2,      // uint16 length, then run-length encoded nibbles
+  TILE_DEFLATE = 3,  // uint16 length, then raw deflate encoded nibbles
+} tile_codec_t;
+
+// Decodes the pixel data of a single rect from the stream, row by row
+class RectDecoder {
+ protected:
+  ResponseStream *stream;
+  Rect_t area;
+  uint32_t row_size;
+
+ public:
+  RectDecoder(ResponseStream *stream, Rect_t area)
+      : stream(stream), area(area), row_size((uint32_t)area.width / 2) {}
+
+  virtual ~RectDecoder() {}
+
+  // Decodes the next rows of the rect into dst, rows are row_size apart
+  virtual st_status readRows(uint8_t *dst, int rows) = 0;
+
+  // Rows must be requested in multiples of this value, only the last call
+  // may be shorter
+  virtual int rowAlignment() { return 1; }
+
+  // Decodes the next row into scratch and points *row to it. Decoders that
+  // find the row in memory point *row there instead of copying it. Only for
+  // a row alignment of 1.
+  virtual st_status borrowRow(const uint8_t **row, uint8_t *scratch) {
+    *row = scratch;
+    return readRows(scratch, 1);
+  }
+};
+
+// Pixel data is sent uncompressed, as in schema version 1
+class RawRectDecoder : public RectDecoder {
+ public:
+  RawRectDecoder(ResponseStream *stream, Rect_t area)
+      : RectDecoder(stream, area) {}
+
+  st_status readRows(uint8_t *dst, int rows) {
+    stream->readBytes(dst, row_size * rows);
+    return stream->getStatus();
+  }
+
+  // Rows are borrowed from streams that hold them in memory, e.g. the window
+  // of InflateStream
+  st_status borrowRow(const uint8_t **row, uint8_t *scratch) {
+    if (!stream->canBorrow()) {
+      return RectDecoder::borrowRow(row, scratch);
+    }
+
+    size_t size = stream->borrow(row, row_size);
+    if (size == row_size || stream->getStatus()) {
+      return stream->getStatus();
+    }
+
+    // The row continues in the next block of the stream
+    memcpy(scratch, *row, size);
+    *row = scratch;
+    stream->readBytes(scratch + size, row_size - size);
+    return stream->getStatus();
+  }
+};
+
+// The rect is split into square tiles, each of them is encoded with its own
+// codec. Tiles at the right and bottom edge are cut off at the rect border.
+class TiledRectDecoder : public RectDecoder {
+ private:
+  int tile_size;
+  uint32_t tile_buffer_size;
+  uint8_t *tile_buffer = NULL;
+  uint8_t *input = NULL;
+  tinfl_decompressor *decompressor = NULL;
+
+  // Reads the length prefixed payload of a compressed tile into input
+  size_t readCompressed() {
+    uint16_t length = stream->readUint16();
+    if (stream->getStatus()) {
+      return 0;
+    }
+    if (length > tile_buffer_size) {
+      // A valid encoder would have sent the tile uncompressed
+      return 0;
+    }
+
+    stream->readBytes(input, length);
+    return stream->getStatus() ? 0 : length;
+  }
+
+  size_t inflateTile(size_t length, size_t tile_bytes) {
+    if (decompressor == NULL) {
+      decompressor =
+          (tinfl_decompressor *)buffer_malloc(sizeof(tinfl_decompressor));
+    }
+
+    tinfl_init(decompressor);
+    size_t in_bytes = length;
+    size_t out_bytes = tile_bytes;
+    tinfl_status result = tinfl_decompress(
+        decompressor, input, &in_bytes, tile_buffer, tile_buffer, &out_bytes,
+        TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    return result == TINFL_STATUS_DONE ? out_bytes : 0;
+  }
+
+  st_status readTile(uint8_t *dst, int tile_width, int tile_height) {
+    uint32_t tile_row_size = tile_width / 2;
+    size_t tile_bytes = tile_row_size * tile_height;
+
+    uint8_t header = stream->readUint8();
+    if (stream->getStatus()) {
+      return stream->getStatus();
+    }
+
+    size_t decoded = 0;
+    switch (header >> 4) {
+      case TILE_SOLID:
+        // Nothing else to read, fill the tile area directly
+        for (int row = 0; row < tile_height; row++) {
+          rle_fill(dst + row * row_size, (header & 0x0F) * 0x11,
+                   tile_row_size);
+        }
+        return ST_OK;
+
+      case TILE_RAW:
+        stream->readBytes(tile_buffer, tile_bytes);
+        if (stream->getStatus()) {
+          return stream->getStatus();
+        }
+        decoded = tile_bytes;
+        break;
+
+      case TILE_RLE: {
+        size_t length = readCompressed();
+        decoded = rle_decode(input, length, tile_buffer, tile_bytes);
+        break;
+      }
+
+      case TILE_DEFLATE: {
+        size_t length = readCompressed();
+        decoded = length > 0 ? inflateTile(length, tile_bytes) : 0;
+        break;
+      }
+    }
+
+    if (stream->getStatus()) {
+      return stream->getStatus();
+    }
+    if (decoded != tile_bytes) {
+      Serial.printf("Invalid tile with header 0x%02x\n", header);
+      return ST_DECOMPRESSION_ERROR;
+    }
+
+    for (int row = 0; row < tile_height; row++) {
+      memcpy(dst + row * row_size, tile_buffer + row * tile_row_size,
+             tile_row_size);
+    }
+    return ST_OK;
+  }
+
+ public:
+  TiledRectDecoder(ResponseStream *stream, Rect_t area, int tile_size)
+      : RectDecoder(stream, area), tile_size(tile_size) {
+    tile_buffer_size = (uint32_t)tile_size * tile_size / 2;
+    tile_buffer = (uint8_t *)buffer_malloc(tile_buffer_size);
+    input = (uint8_t *)buffer_malloc(tile_buffer_size);
+  }
+
+  ~TiledRectDecoder() {
+    buffer_free(decompressor);
+    buffer_free(input);
+    buffer_free(tile_buffer);
+  }
+
+  int rowAlignment() { return tile_size; }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    for (int row = 0; row < rows; row += tile_size) {
+      int tile_height = min(tile_size, rows - row);
+      for (int x = 0; x < area.width; x += tile_size) {
+        int tile_width = min(tile_size, area.width - x);
+        st_status result =
+            readTile(dst + row * row_size + x / 2, tile_width, tile_height);
+        if (result) {
+          return result;
+        }
+      }
+    }
+    return ST_OK;
+  }
+};
+
+// Pixels are sent as palette indices with 1, 2 or 4 bits per pixel and are
+// expanded to gray levels row by row
+class IndexedRectDecoder : public RectDecoder {
+ private:
+  PaletteExpander expander;
+  uint32_t packed_row_size;
+  uint8_t *packed_row;
+  uint32_t *expanded_row;
+
+ public:
+  IndexedRectDecoder(ResponseStream *stream, Rect_t area, int bpp,
+                     const uint8_t *palette, int palette_size)
+      : RectDecoder(stream, area) {
+    expander.init(bpp, palette, palette_size);
+    packed_row_size = expander.packedRowSize(area.width);
+
+    // The kernel reads and writes whole words beyond the end of a row
+    packed_row = (uint8_t *)buffer_malloc(packed_row_size + 4);
+    memset(packed_row, 0, packed_row_size + 4);
+    expanded_row = (uint32_t *)buffer_malloc(row_size + 4);
+  }
+
+  ~IndexedRectDecoder() {
+    buffer_free(expanded_row);
+    buffer_free(packed_row);
+  }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    for (int row = 0; row < rows; row++) {
+      stream->readBytes(packed_row, packed_row_size);
+      if (stream->getStatus()) {
+        return stream->getStatus();
+      }
+
+      expander.expandRow(packed_row, expanded_row, area.width);
+      memcpy(dst + row * row_size, expanded_row, row_size);
+    }
+    return ST_OK;
+  }
+};
+
+// Every row is sent as four bit planes, which are interleaved into nibbles
+class BitPlaneRectDecoder : public RectDecoder {
+ private:
+  uint32_t planes_size;
+  uint8_t *planes;
+  uint32_t *interleaved_row;
+
+ public:
+  BitPlaneRectDecoder(ResponseStream *stream, Rect_t area)
+      : RectDecoder(stream, area) {
+    planes_size = BIT_PLANES * bitplane_row_size(area.width);
+    planes = (uint8_t *)buffer_malloc(planes_size);
+    // The kernel writes whole words beyond the end of a row
+    interleaved_row = (uint32_t *)buffer_malloc(planes_size);
+  }
+
+  ~BitPlaneRectDecoder() {
+    buffer_free(interleaved_row);
+    buffer_free(planes);
+  }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    for (int row = 0; row < rows; row++) {
+      stream->readBytes(planes, planes_size);
+      if (stream->getStatus()) {
+        return stream->getStatus();
+      }
+
+      bitplane_interleave_row(planes, interleaved_row, area.width);
+      memcpy(dst + row * row_size, interleaved_row, row_size);
+    }
+    return ST_OK;
+  }
+};
+
+// Pixels are sent at a lower resolution. Every row is expanded once and then
+// repeated, repeated rows are borrowed without copying them.
+class ScaledRectDecoder : public RectDecoder {
+ private:
+  int scale;
+  int source_width;
+  uint8_t *source_row;
+  uint8_t *expanded_row;
+  int repeats = 0;  // how often the expanded row is still used
+
+  st_status nextRow() {
+    if (repeats == 0) {
+      stream->readBytes(source_row, source_width / 2);
+      if (stream->getStatus()) {
+        return stream->getStatus();
+      }
+      scale_expand_row(source_row, expanded_row, source_width, scale);
+      repeats = scale;
+    }
+    repeats--;
+    return ST_OK;
+  }
+
+ public:
+  ScaledRectDecoder(ResponseStream *stream, Rect_t area, int scale)
+      : RectDecoder(stream, area), scale(scale) {
+    source_width = area.width / scale;
+    source_row = (uint8_t *)buffer_malloc(source_width / 2);
+    expanded_row = (uint8_t *)buffer_malloc(row_size);
+  }
+
+  ~ScaledRectDecoder() {
+    buffer_free(expanded_row);
+    buffer_free(source_row);
+  }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    for (int row = 0; row < rows; row++) {
+      st_status result = nextRow();
+      if (result) {
+        return result;
+      }
+      memcpy(dst + row * row_size, expanded_row, row_size);
+    }
+    return ST_OK;
+  }
+
+  st_status borrowRow(const uint8_t **row, uint8_t *scratch) {
+    *row = expanded_row;
+    return nextRow();
+  }
+};
+
+// Black and white pixels coded with Group 4. Each line is decoded into the
+// positions of its color changes, which are rendered as 0x0 and 0xF nibbles.
+class G4RectDecoder : public RectDecoder, private G4Decoder {
+ private:
+  uint32_t remaining;  // coded bytes not read from the stream yet
+  int rows_done = 0;
+  uint16_t *reference;
+  uint16_t *current;
+
+ protected:
+  size_t fill(uint8_t *buffer, size_t size) {
+    size_t length = min(size, (size_t)remaining);
+    if (length == 0) {
+      return 0;
+    }
+    length = stream->readBytes(buffer, length);
+    remaining -= length;
+    return length;
+  }
+
+ public:
+  G4RectDecoder(ResponseStream *stream, Rect_t area, uint32_t length)
+      : RectDecoder(stream, area), remaining(length) {
+    size_t size = g4_changes_size(area.width) * sizeof(uint16_t);
+    reference = (uint16_t *)buffer_malloc(size);
+    current = (uint16_t *)buffer_malloc(size);
+    begin(area.width, reference, current);
+  }
+
+  ~G4RectDecoder() {
+    buffer_free(current);
+    buffer_free(reference);
+  }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    for (int row = 0; row < rows; row++) {
+      if (!decodeLine()) {
+        Serial.printf("Invalid Group 4 data in line %d\n", rows_done + row);
+        return stream->getStatus() ? stream->getStatus()
+                                   : ST_DECOMPRESSION_ERROR;
+      }
+      g4_render_line(getChanges(), getChangeCount(), area.width,
+                     dst + row * row_size);
+    }
+
+    rows_done += rows;
+    if (rows_done == area.height) {
+      // Skip the end of block code and padding
+      uint8_t scratch[G4_INPUT_SIZE];
+      while (remaining > 0 && fill(scratch, sizeof(scratch)) > 0) {
+      }
+      return stream->getStatus();
+    }
+    return ST_OK;
+  }
+};
+
+// The rect is a complete 4 bit grayscale PNG file. The image data is inflated
+// while it is received and unfiltered row by row.
+class PngRectDecoder : public RectDecoder {
+ private:
+  PngDataStream data;
+  InflateStream inflate;
+  bool started = false;
+  int rows_done = 0;
+
+  // Inflated rows with their filter byte, the unfiltered previous row is
+  // needed by the Up, Average and Paeth filters
+  uint32_t png_row_size;
+  uint8_t *row;
+  uint8_t *previous;
+
+  st_status readHeader() {
+    uint8_t header[PNG_SIGNATURE_SIZE + PNG_CHUNK_HEADER_SIZE + PNG_IHDR_SIZE];
+    stream->readBytes(header, sizeof(header));
+    if (stream->getStatus()) {
+      return stream->getStatus();
+    }
+
+    const uint8_t *chunk = header + PNG_SIGNATURE_SIZE;
+    const uint8_t *ihdr = chunk + PNG_CHUNK_HEADER_SIZE;
+    if (memcmp(header, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) ||
+        png_read_uint32(chunk) != PNG_IHDR_SIZE ||
+        png_read_uint32(chunk + 4) != PNG_CHUNK_IHDR) {
+      Serial.println("Rect is no PNG file");
+      return ST_DECOMPRESSION_ERROR;
+    }
+
+    uint32_t width = png_read_uint32(ihdr);
+    uint32_t height = png_read_uint32(ihdr + 4);
+    uint8_t bit_depth = ihdr[8];
+    uint8_t color_type = ihdr[9];
+    bool interlaced = ihdr[12];
+    if (width != (uint32_t)area.width || height != (uint32_t)area.height ||
+        bit_depth != 4 || color_type != PNG_COLOR_TYPE_GRAY || interlaced) {
+      Serial.printf("Unsupported PNG: %ux%u, %u bit, color type %u\n", width,
+                    height, bit_depth, color_type);
+      return ST_DECOMPRESSION_ERROR;
+    }
+    return ST_OK;
+  }
+
+  st_status readError() {
+    if (stream->getStatus()) {
+      return stream->getStatus();
+    } else if (inflate.getStatus() > ST_STREAM_END_UNEXPECTED) {
+      return inflate.getStatus();
+    }
+    // The image data ended before the last row
+    return ST_DECOMPRESSION_ERROR;
+  }
+
+ public:
+  PngRectDecoder(ResponseStream *stream, Rect_t area)
+      : RectDecoder(stream, area), data(stream), inflate(&data) {
+    png_row_size = ((uint32_t)area.width * 4 + 7) / 8;
+    row = (uint8_t *)buffer_malloc(png_row_size + 1);
+    previous = (uint8_t *)buffer_malloc(png_row_size + 1);
+    memset(previous, 0, png_row_size + 1);
+  }
+
+  ~PngRectDecoder() {
+    buffer_free(previous);
+    buffer_free(row);
+  }
+
+  st_status readRows(uint8_t *dst, int rows) {
+    if (!started) {
+      started = true;
+      st_status result = readHeader();
+      if (result) {
+        return result;
+      }
+    }
+
+    for (int i = 0; i < rows; i++) {
+      inflate.readBytes(row, png_row_size + 1);
+      if (inflate.getStatus()) {
+        return readError();
+      }
+      if (!png_unfilter_row(row[0], row + 1, previous + 1, png_row_size)) {
+        Serial.printf("Invalid PNG filter %u\n", row[0]);
+        return ST_DECOMPRESSION_ERROR;
+      }
+      png_swap_nibbles(row + 1, dst + i * row_size, row_size);
+
+      uint8_t *unfiltered = row;
+      row = previous;
+      previous = unfiltered;
+    }
+
+    rows_done += rows;
+    if (rows_done == area.height) {
+      // Consume the rest of the file up to the IEND chunk
+      return inflate.finish();
+    }
+    return ST_OK;
+  }
+};
@@ -2,12 +2,32 @@
 #include <miniz.h>
 
 #include "epd_driver.h"  // Definitions for screen width and height
+#include "rect_decoder.h"
+#include "schema.h"
 #include "screen_io.h"
+#include "sections.h"
 #include "stream.cpp"
+#include "transform.h"
 
-#define SUPPORTED_VERSIONS "1,2"
+#ifdef BOARD_HAS_PSRAM
+#include "framebuffer.h"
+#endif
+
+#define SUPPORTED_VERSIONS "1,2,4,5,6,7,8,9,10,11,12"
+#define RETAINED_VERSIONS "3,13"  // only if the displayed image is retained
 #define DBG_OUTPUT_PORT Serial
 
+// Without PSRAM rects are not buffered completely but drawn in horizontal
+// bands of as many rows as fit into this buffer
+#define BAND_BUFFER_SIZE 1024 * 16
+
+// Size of the screen in the orientation the server renders for, rects are
+// moved to their place on the panel with DISPLAY_TRANSFORM
+#define SCREEN_WIDTH \
+  (transform_swaps_axes(DISPLAY_TRANSFORM) ? EPD_HEIGHT : EPD_WIDTH)
+#define SCREEN_HEIGHT \
+  (transform_swaps_axes(DISPLAY_TRANSFORM) ? EPD_WIDTH : EPD_HEIGHT)
+
 typedef enum {
   SUCCESS = 0,
   UNEXPECTED_STATUS_CODE = 1,
@@ -18,140 +38,745 @@ typedef enum {
   HEIGHT_TOO_HIGH = 6,
   PAYLOAD_TOO_LARGE = 7,
   UNKNOWN_ERROR = 8,
+  MISSING_FRAMEBUFFER = 9,
+  CHECKSUM_MISMATCH = 10,
+  UNKNOWN_CONTENT_ENCODING = 11,
 } net_state_t;
 
-net_state_t process_stream_V1(ResponseStream *stream, uint32_t *imageId,
-                              uint32_t *sleepTime) {
-  stream->readUint32(imageId);
-  if (stream->getStatus()) {
-    write_error("Stream ended unexpectedly while reading imageId");
-    return UNEXPECTED_END_OF_STREAM;
+// How the pixels of a rect are combined with the current display content
+typedef enum {
+  RECT_REPLACE = 0,
+  RECT_DELTA = 1,  // pixels are XORed onto the retained framebuffer
+} rect_mode_t;
+
+// Versions announced to the server, some of them depend on the current state
+// of the device
+String supported_versions() {
+#ifdef BOARD_HAS_PSRAM
+  if (framebuffer.isRetained()) {
+    // Delta frames and transparent rects can only be applied if the
+    // displayed image is known
+    return SUPPORTED_VERSIONS "," RETAINED_VERSIONS;
   }
-  DBG_OUTPUT_PORT.printf("Image id: %u\n", imageId);
+#endif
+  return SUPPORTED_VERSIONS;
+}
 
-  stream->readUint32(sleepTime);
-  if (stream->getStatus()) {
-    write_error("Stream ended unexpectedly while reading sleepTime");
-    return UNEXPECTED_END_OF_STREAM;
+// Area of a rect on the panel
+Rect_t panel_area(Rect_t area) {
+  int x = area.x;
+  int y = area.y;
+  int width = area.width;
+  int height = area.height;
+  transform_rect(DISPLAY_TRANSFORM, SCREEN_WIDTH, SCREEN_HEIGHT, &x, &y,
+                 &width, &height);
+  return {.x = x, .y = y, .width = width, .height = height};
+}
+
+#ifdef BOARD_HAS_PSRAM
+
+// Composites pixels that are already in the orientation of the panel
+void blit_pixels(Rect_t area, uint8_t *pixel, rect_mode_t mode) {
+  if (!framebuffer.blit(area, pixel, mode == RECT_DELTA)) {
+    epd_clear_area(area);
+    epd_draw_image(area, pixel, BLACK_ON_WHITE);
   }
-  DBG_OUTPUT_PORT.printf("Sleep time: %u\n", sleepTime);
+}
 
-  if (&sleepTime <= 0) {
-    write_error("Received sleep time with value 0");
-    return INVALID_SLEEP_TIME;
+// Composites the decoded pixels of a rect into the framebuffer. The rect is
+// only drawn directly if the framebuffer does not know the current display
+// content yet. Rects of a rotated display are transformed first, full width
+// ones straight into the framebuffer.
+void draw_pixels(Rect_t area, uint8_t *pixel, rect_mode_t mode) {
+  if (DISPLAY_TRANSFORM == TRANSFORM_NONE) {
+    blit_pixels(area, pixel, mode);
+    return;
   }
 
-  // Repeat as long as the stream continues
-  while (true) {
-    uint16_t x = stream->readUint16();
-    if (stream->getStatus() == ST_STREAM_END) {
-      // stream is finished, nothing more to read; we are done here!
-      break;
-    } else if (stream->getStatus()) {
-      write_error("Stream ended unexpectedly while reading x");
-      return UNEXPECTED_END_OF_STREAM;
+  Rect_t target = panel_area(area);
+  uint8_t *rows = mode == RECT_REPLACE ? framebuffer.getRows(target) : NULL;
+  if (rows != NULL) {
+    transform_pixels(DISPLAY_TRANSFORM, pixel, area.width, area.height, rows);
+    if (!framebuffer.commit(target)) {
+      epd_clear_area(target);
+      epd_draw_image(target, rows, BLACK_ON_WHITE);
     }
-    DBG_OUTPUT_PORT.printf("x: %u\n", x);
+    return;
+  }
 
-    uint16_t y = stream->readUint16();
-    if (stream->getStatus()) {
-      write_error("Stream ended unexpectedly while reading y");
-      return UNEXPECTED_END_OF_STREAM;
+  uint8_t *transformed =
+      (uint8_t *)buffer_malloc((uint32_t)area.width * area.height / 2);
+  transform_pixels(DISPLAY_TRANSFORM, pixel, area.width, area.height,
+                   transformed);
+  blit_pixels(target, transformed, mode);
+  buffer_free(transformed);
+}
+
+// The framebuffer knows the display content, so rows are composited as soon
+// as they are decoded, without a buffer for the whole rect. Rows the stream
+// holds in memory are not copied at all. A broken rect leaves decoded rows in
+// the framebuffer, but it is neither drawn nor saved then.
+st_status composite_rows(RectDecoder *decoder, Rect_t area, rect_mode_t mode) {
+  uint8_t *scratch = (uint8_t *)buffer_malloc(area.width / 2);
+  st_status result = ST_OK;
+  for (int row = 0; row < area.height && result == ST_OK; row++) {
+    const uint8_t *pixel;
+    result = decoder->borrowRow(&pixel, scratch);
+    if (result == ST_OK) {
+      framebuffer.blitRow(area, row, pixel, mode == RECT_DELTA);
     }
-    DBG_OUTPUT_PORT.printf("y: %u\n", y);
+  }
+  buffer_free(scratch);
 
-    uint16_t width = stream->readUint16();
-    if (stream->getStatus()) {
-      write_error("Stream ended unexpectedly while reading width");
-      return UNEXPECTED_END_OF_STREAM;
+  if (result == ST_OK) {
+    framebuffer.commit(area);
+  }
+  return result;
+}
+
+// Composites a rect onto the retained framebuffer. Pixels of the key level
+// are left out, the current display content stays visible there. Rotated
+// rects are transformed as a whole first.
+st_status draw_keyed(RectDecoder *decoder, Rect_t area, uint8_t key) {
+  st_status result = ST_OK;
+  if (DISPLAY_TRANSFORM == TRANSFORM_NONE) {
+    uint8_t *scratch = (uint8_t *)buffer_malloc(area.width / 2);
+    for (int row = 0; row < area.height && result == ST_OK; row++) {
+      const uint8_t *pixel;
+      result = decoder->borrowRow(&pixel, scratch);
+      if (result == ST_OK) {
+        framebuffer.blitRowKeyed(area, row, pixel, key);
+      }
     }
-    DBG_OUTPUT_PORT.printf("width: %u\n", width);
-    if (width > EPD_WIDTH) {
-      write_error("Image returned from server is to wide: " + String(width));
-      return WIDTH_TOO_HIGH;
+    buffer_free(scratch);
+    if (result == ST_OK) {
+      framebuffer.commit(area);
     }
+    return result;
+  }
 
-    uint16_t height = stream->readUint16();
-    if (stream->getStatus()) {
-      write_error("Stream ended unexpectedly while reading height");
-      return UNEXPECTED_END_OF_STREAM;
+  uint32_t size = (uint32_t)area.width * area.height / 2;
+  uint8_t *pixel = (uint8_t *)buffer_malloc(size);
+  uint8_t *transformed = (uint8_t *)buffer_malloc(size);
+  result = decoder->readRows(pixel, area.height);
+  if (result == ST_OK) {
+    Rect_t target = panel_area(area);
+    transform_pixels(DISPLAY_TRANSFORM, pixel, area.width, area.height,
+                     transformed);
+    for (int row = 0; row < target.height; row++) {
+      framebuffer.blitRowKeyed(target, row,
+                               transformed + row * (target.width / 2), key);
     }
-    DBG_OUTPUT_PORT.printf("height: %u\n", height);
-    if (height > EPD_HEIGHT) {
-      write_error("Image returned from server is to tall: " + String(height));
-      return HEIGHT_TOO_HIGH;
+    framebuffer.commit(target);
+  }
+  buffer_free(transformed);
+  buffer_free(pixel);
+  return result;
+}
+
+// Reads the complete pixel data of a rect into PSRAM and draws it
+st_status draw_rect(RectDecoder *decoder, Rect_t area, rect_mode_t mode) {
+  if (framebuffer.isRetained() && decoder->rowAlignment() == 1 &&
+      area.width % 2 == 0 && DISPLAY_TRANSFORM == TRANSFORM_NONE) {
+    return composite_rows(decoder, area, mode);
+  }
+
+  uint32_t size = (uint32_t)area.width * area.height / 2;
+  uint8_t *pixel = (uint8_t *)buffer_malloc(size);
+
+  st_status result = decoder->readRows(pixel, area.height);
+  if (result == ST_OK) {
+    draw_pixels(area, pixel, mode);
+  }
+  buffer_free(pixel);
+  return result;
+}
+
+// Draws all rects composited since the last call in a single pass
+void flush_rects() { framebuffer.flush(); }
+
+#else
+
+uint8_t band_buffer[BAND_BUFFER_SIZE];
+
+// Reads the pixel data of a rect band by band into a static buffer in SRAM
+// and draws each band as soon as it is complete. A band is only cleared once
+// its pixels decoded, so a broken rect keeps the previous content below it.
+// Only RECT_REPLACE is supported since there is no framebuffer. On a rotated
+// display the second half of the buffer takes the transformed band.
+st_status draw_rect(RectDecoder *decoder, Rect_t area, rect_mode_t mode) {
+  bool transformed = DISPLAY_TRANSFORM != TRANSFORM_NONE;
+  uint32_t buffer_size = transformed ? BAND_BUFFER_SIZE / 2 : BAND_BUFFER_SIZE;
+  uint32_t row_size = (uint32_t)area.width / 2;
+  int band_rows = buffer_size / max(row_size, (uint32_t)1);
+  band_rows -= band_rows % decoder->rowAlignment();
+  if (transformed) {
+    // Rotated bands are transposed in blocks of two rows
+    band_rows &= ~1;
+  }
+  if (band_rows == 0) {
+    Serial.println("Rows of the rect do not fit into the band buffer");
+    return ST_TOO_LARGE;
+  }
+
+  for (int row = 0; row < area.height; row += band_rows) {
+    Rect_t band = {
+        .x = area.x,
+        .y = area.y + row,
+        .width = area.width,
+        .height = min(band_rows, area.height - row),
+    };
+
+    st_status result = decoder->readRows(band_buffer, band.height);
+    if (result) {
+      return result;
     }
 
-    uint32_t size = (uint32_t)width * height / 2;
-    if (size == 0) {
-      return SUCCESS;
+    uint8_t *pixels = band_buffer;
+    if (transformed) {
+      pixels = band_buffer + buffer_size;
+      transform_pixels(DISPLAY_TRANSFORM, band_buffer, band.width,
+                       band.height, pixels);
     }
+    epd_clear_area(panel_area(band));
+    epd_draw_image(panel_area(band), pixels, BLACK_ON_WHITE);
+  }
+  return ST_OK;
+}
 
-    uint8_t *pixel = (uint8_t *)ps_malloc(size);
-    Rect_t area = {
-        .x = x,
-        .y = y,
-        .width = width,
-        .height = height,
-    };
+// Bands are drawn immediately, there is nothing to flush
+void flush_rects() {}
+
+#endif
+
+// Checks the encoding specific fields of a rect header
+net_state_t validate_rect(const raw_rect_header_t &header) { return SUCCESS; }
+
+net_state_t validate_rect(const png_rect_header_t &header) { return SUCCESS; }
 
-    stream->readBytes(pixel, size);
+net_state_t validate_rect(const planar_rect_header_t &header) {
+  if (header.flags & ~RECT_FLAG_BIT_PLANES) {
+    write_error("Unknown rect flags: " + String(header.flags));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const encoded_rect_header_t &header) {
+  const rect_header_t &rect = header.rect;
+  if (header.encoding > RECT_ENCODING_G4) {
+    write_error("Unknown rect encoding: " + String(header.encoding));
+    return UNKNOWN_ERROR;
+  } else if (header.encoding == RECT_ENCODING_RAW &&
+             header.length != (uint32_t)rect.width * rect.height / 2) {
+    write_error("Invalid rect length: " + String(header.length));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const section_header_t &header) {
+  // Stored deflate blocks add 5 bytes per 64 KB to the pixels, an encoder
+  // never needs more
+  const rect_header_t &rect = header.rect;
+  uint32_t size = (uint32_t)rect.width * rect.height / 2;
+  if (header.length == 0 || header.length > size + size / 1024 + 64) {
+    write_error("Invalid section length: " + String(header.length));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const scaled_rect_header_t &header) {
+  const rect_header_t &rect = header.rect;
+  int scale = header.scale;
+  if (scale == 0 || scale > SCALE_MAX || rect.width % (2 * scale) ||
+      rect.height % scale) {
+    write_error("Invalid scale " + String(scale) + " for " +
+                String(rect.width) + "x" + String(rect.height));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const keyed_rect_header_t &header) {
+  if (header.key > 0x0F && header.key != RECT_KEY_OPAQUE) {
+    write_error("Invalid transparent level: " + String(header.key));
+    return UNKNOWN_ERROR;
+  } else if (header.key != RECT_KEY_OPAQUE && header.rect.width % 2) {
+    write_error("Transparent rects need an even width: " +
+                String(header.rect.width));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const tiled_rect_header_t &header) {
+  if (header.tile_size == 0 || header.tile_size % 2) {
+    write_error("Invalid tile size: " + String(header.tile_size));
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+net_state_t validate_rect(const indexed_rect_header_t &header) {
+  uint8_t bpp = header.bpp;
+  if ((bpp != 1 && bpp != 2 && bpp != 4) || header.palette_size > (1 << bpp)) {
+    write_error("Invalid pixel format: " + String(bpp) + " bpp, " +
+                String(header.palette_size) + " colors");
+    return UNKNOWN_ERROR;
+  }
+  return SUCCESS;
+}
+
+// Decodes the pixel data that follows a rect header
+st_status draw_rect(ResponseStream *stream, const raw_rect_header_t &header,
+                    Rect_t area, rect_mode_t mode) {
+  RawRectDecoder decoder(stream, area);
+  return draw_rect(&decoder, area, mode);
+}
+
+st_status draw_rect(ResponseStream *stream, const tiled_rect_header_t &header,
+                    Rect_t area, rect_mode_t mode) {
+  TiledRectDecoder decoder(stream, area, header.tile_size);
+  return draw_rect(&decoder, area, mode);
+}
+
+st_status draw_rect(ResponseStream *stream,
+                    const indexed_rect_header_t &header, Rect_t area,
+                    rect_mode_t mode) {
+  uint8_t palette[PALETTE_MAX_SIZE];
+  if (header.palette_size > 0) {
+    stream->readBytes(palette, header.palette_size);
     if (stream->getStatus()) {
-      write_error("Stream ended unexpectedly while reading image data");
-      free(pixel);
-      return UNEXPECTED_END_OF_STREAM;
+      return stream->getStatus();
     }
+  }
 
-    epd_clear_area(area);
-    epd_draw_image(area, pixel, BLACK_ON_WHITE);
-    free(pixel);
+  IndexedRectDecoder decoder(stream, area, header.bpp, palette,
+                             header.palette_size);
+  return draw_rect(&decoder, area, mode);
+}
+
+st_status draw_rect(ResponseStream *stream, const png_rect_header_t &header,
+                    Rect_t area, rect_mode_t mode) {
+  PngRectDecoder decoder(stream, area);
+  return draw_rect(&decoder, area, mode);
+}
+
+st_status draw_rect(ResponseStream *stream,
+                    const planar_rect_header_t &header, Rect_t area,
+                    rect_mode_t mode) {
+  if (header.flags & RECT_FLAG_BIT_PLANES) {
+    BitPlaneRectDecoder decoder(stream, area);
+    return draw_rect(&decoder, area, mode);
   }
+  RawRectDecoder decoder(stream, area);
+  return draw_rect(&decoder, area, mode);
+}
 
-  return SUCCESS;
+st_status draw_rect(ResponseStream *stream,
+                    const encoded_rect_header_t &header, Rect_t area,
+                    rect_mode_t mode) {
+  if (header.encoding == RECT_ENCODING_G4) {
+    G4RectDecoder decoder(stream, area, header.length);
+    return draw_rect(&decoder, area, mode);
+  }
+  RawRectDecoder decoder(stream, area);
+  return draw_rect(&decoder, area, mode);
+}
+
+st_status draw_rect(ResponseStream *stream,
+                    const scaled_rect_header_t &header, Rect_t area,
+                    rect_mode_t mode) {
+  if (header.scale > 1) {
+    ScaledRectDecoder decoder(stream, area, header.scale);
+    return draw_rect(&decoder, area, mode);
+  }
+  RawRectDecoder decoder(stream, area);
+  return draw_rect(&decoder, area, mode);
 }
 
-net_state_t process_stream_V2(HttpStream *stream, uint32_t *imageId,
+#ifdef BOARD_HAS_PSRAM
+
+st_status draw_rect(ResponseStream *stream, const keyed_rect_header_t &header,
+                    Rect_t area, rect_mode_t mode) {
+  RawRectDecoder decoder(stream, area);
+  if (header.key == RECT_KEY_OPAQUE) {
+    return draw_rect(&decoder, area, mode);
+  }
+  return draw_keyed(&decoder, area, header.key);
+}
+
+#endif
+
+// Inflates a section while it is received, for devices that cannot hold it
+// in memory
+st_status draw_rect(ResponseStream *stream, const section_header_t &header,
+                    Rect_t area, rect_mode_t mode) {
+  LimitedStream section(stream, header.length);
+  InflateStream pixels(&section);
+  RawRectDecoder decoder(&pixels, area);
+  st_status result = draw_rect(&decoder, area, mode);
+  if (result) {
+    return result;
+  }
+
+  // Reading past the pixels verifies the zlib trailer
+  uint8_t extra;
+  if (pixels.readBytes(&extra, 1) > 0 ||
+      pixels.getStatus() > ST_STREAM_END_UNEXPECTED) {
+    return ST_DECOMPRESSION_ERROR;
+  }
+  return section.finish();
+}
+
+// Reads the image id and sleep time that follow the version byte
+net_state_t read_image_header(ResponseStream *stream, uint32_t *imageId,
                               uint32_t *sleepTime) {
-  // The response length is not perfect, but if it is set, we try to read
-  // exactly the specified length
-  long compressed_length = stream->getExpectedRemainingSize();
-  if (compressed_length <= 0) {
-    compressed_length = MAX_SIZE;
-  }
-  unsigned char *compressed_bytes =
-      (unsigned char *)ps_malloc(compressed_length);
-  size_t compressed_size =
-      stream->readBytes(compressed_bytes, compressed_length);
-
-  if (compressed_size >= MAX_SIZE) {
-    free(compressed_bytes);
-    write_error("Payload too large: " + String(compressed_size));
-    return PAYLOAD_TOO_LARGE;
-  }
-
-  mz_ulong extracted_size = MAX_SIZE;
-  unsigned char *extracted_bytes = (unsigned char *)ps_malloc(extracted_size);
-  int result_code = mz_uncompress(extracted_bytes, &extracted_size,
-                                  compressed_bytes, compressed_size);
-  free(compressed_bytes);
-  DBG_OUTPUT_PORT.printf("Compressed size: %u, Decompressed size: %u\n",
-                         compressed_size, extracted_size);
-
-  if (result_code != MZ_OK) {
-    write_error("Decompression error: MZ_" + String(result_code));
-    free(extracted_bytes);
+  image_header_t image;
+  stream->readHeader(&image);
+  if (stream->getStatus()) {
+    write_error("Stream ended unexpectedly while reading image header");
+    return UNEXPECTED_END_OF_STREAM;
+  }
+  *imageId = image.image_id;
+  *sleepTime = image.sleep_time;
+  DBG_OUTPUT_PORT.printf("Image id: %u, sleep time: %u\n", *imageId,
+                         *sleepTime);
+
+  if (*sleepTime == 0) {
+    write_error("Received sleep time with value 0");
+    return INVALID_SLEEP_TIME;
+  }
+  return SUCCESS;
+}
+
+// Reads and checks the next rect header. The area is empty if the image has
+// no more rects.
+template <typename RectHeader>
+net_state_t read_rect_header(ResponseStream *stream, RectHeader *header,
+                             Rect_t *area) {
+  *area = {.x = 0, .y = 0, .width = 0, .height = 0};
+  stream->readHeader(header);
+  if (stream->getStatus() == ST_STREAM_END) {
+    // stream is finished, nothing more to read; we are done here!
+    return SUCCESS;
+  } else if (stream->getStatus()) {
+    write_error("Stream ended unexpectedly while reading rect header");
+    return UNEXPECTED_END_OF_STREAM;
+  }
+
+  const rect_header_t &rect = header->rect;
+  DBG_OUTPUT_PORT.printf("Rect x: %u, y: %u, width: %u, height: %u\n",
+                         rect.x, rect.y, rect.width, rect.height);
+  if ((uint32_t)rect.x + rect.width > SCREEN_WIDTH) {
+    write_error("Image returned from server is to wide: " +
+                String(rect.width));
+    return WIDTH_TOO_HIGH;
+  }
+  if ((uint32_t)rect.y + rect.height > SCREEN_HEIGHT) {
+    write_error("Image returned from server is to tall: " +
+                String(rect.height));
+    return HEIGHT_TOO_HIGH;
+  }
+
+  uint32_t size = (uint32_t)rect.width * rect.height / 2;
+  if (size == 0) {
+    return SUCCESS;
+  }
+
+  if (DISPLAY_TRANSFORM != TRANSFORM_NONE &&
+      (rect.width % 2 ||
+       (transform_swaps_axes(DISPLAY_TRANSFORM) && rect.height % 2))) {
+    write_error("Rects of a rotated display need an even size: " +
+                String(rect.width) + "x" + String(rect.height));
     return UNKNOWN_ERROR;
   }
 
-  BufferedStream buffer(extracted_bytes, extracted_size);
+  net_state_t valid = validate_rect(*header);
+  if (valid != SUCCESS) {
+    return valid;
+  }
+
+  *area = {
+      .x = rect.x,
+      .y = rect.y,
+      .width = rect.width,
+      .height = rect.height,
+  };
+  return SUCCESS;
+}
 
-  // v2 is v1 with compressed payload, so we can just call the v1 version
-  net_state_t result = process_stream_V1(&buffer, imageId, sleepTime);
-  free(extracted_bytes);
+bool is_empty(Rect_t area) {
+  return (uint32_t)area.width * area.height / 2 == 0;
+}
+
+net_state_t check_draw_result(st_status result) {
+  if (result == ST_DECOMPRESSION_ERROR || result == ST_TOO_LARGE) {
+    write_error("Invalid image data");
+    return UNKNOWN_ERROR;
+  } else if (result) {
+    write_error("Stream ended unexpectedly while reading image data");
+    return UNEXPECTED_END_OF_STREAM;
+  }
+  return SUCCESS;
+}
+
+// Called after the last rect. The composited rects are only drawn if the
+// body arrived intact.
+net_state_t finish_image(ResponseStream *stream) {
+  st_status result = stream->finish();
+  if (result == ST_CHECKSUM_ERROR) {
+    write_error("Image data is corrupted");
+    return CHECKSUM_MISMATCH;
+  } else if (result) {
+    write_error("Stream ended unexpectedly after the image data");
+    return UNEXPECTED_END_OF_STREAM;
+  }
+
+  flush_rects();
+  return SUCCESS;
+}
+
+// Parses the v1 layout. The rect header type selects how the pixel data of
+// the rects is encoded, see schema.h.
+template <typename RectHeader = raw_rect_header_t>
+net_state_t process_stream_V1(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime,
+                              rect_mode_t mode = RECT_REPLACE) {
+  net_state_t result = read_image_header(stream, imageId, sleepTime);
+  if (result != SUCCESS) {
+    return result;
+  }
+
+  // Repeat as long as the stream continues
+  while (true) {
+    RectHeader header;
+    Rect_t area;
+    result = read_rect_header(stream, &header, &area);
+    if (result != SUCCESS) {
+      return result;
+    } else if (is_empty(area)) {
+      break;
+    }
+
+    result = check_draw_result(draw_rect(stream, header, area, mode));
+    if (result != SUCCESS) {
+      return result;
+    }
+  }
+  return finish_image(stream);
+}
+
+// Versions with a compressed payload are v1 (or one of its rect encodings)
+// behind a codec. Every codec is a DecoderStream, the payload is decompressed
+// while it is received and directly handed to the v1 parser, so rects are
+// drawn before the download is finished.
+template <typename Codec, typename RectHeader = raw_rect_header_t>
+net_state_t process_encoded_stream(ResponseStream *stream, uint32_t *imageId,
+                                   uint32_t *sleepTime,
+                                   rect_mode_t mode = RECT_REPLACE) {
+  Codec codec(stream);
+  uint32_t start = millis();
+  net_state_t result =
+      process_stream_V1<RectHeader>(&codec, imageId, sleepTime, mode);
+  DBG_OUTPUT_PORT.printf(
+      "Compressed size: %u, Decompressed size: %u, Decoded in %u ms\n",
+      codec.getCompressedSize(), codec.getDecompressedSize(),
+      millis() - start);
   return result;
 }
 
-net_state_t process_stream(HttpStream *stream, uint32_t *imageId,
+net_state_t process_stream_V2(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v2 is v1 with zlib compressed payload
+  return process_encoded_stream<InflateStream>(stream, imageId, sleepTime);
+}
+
+#ifdef BOARD_HAS_PSRAM
+
+net_state_t process_stream_V3(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  if (!framebuffer.isRetained()) {
+    write_error("Received delta frame without a retained image");
+    return MISSING_FRAMEBUFFER;
+  }
+
+  // v3 is v2 with rect pixels XORed against the retained image
+  return process_encoded_stream<InflateStream>(stream, imageId, sleepTime,
+                                               RECT_DELTA);
+}
+
+#endif
+
+net_state_t process_stream_V4(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v4 is v1 encoded with the run-length codec
+  return process_encoded_stream<RleStream>(stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V5(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v5 is v1 with every rect split into individually encoded tiles
+  return process_stream_V1<tiled_rect_header_t>(stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V6(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v6 is v2 with palette indices of 1, 2 or 4 bits per pixel
+  return process_encoded_stream<InflateStream, indexed_rect_header_t>(
+      stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V7(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v7 is v1 in an LZ4 frame, decoded faster than zlib at a slightly worse
+  // ratio
+  return process_encoded_stream<Lz4Stream>(stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V8(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v8 is v1 with every rect sent as a 4 bit grayscale PNG file, the PNG
+  // filters predict pixels from their neighbours before deflate
+  return process_stream_V1<png_rect_header_t>(stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V9(ResponseStream *stream, uint32_t *imageId,
+                              uint32_t *sleepTime) {
+  // v9 is v2 with rects that may be sent as bit planes
+  return process_encoded_stream<InflateStream, planar_rect_header_t>(
+      stream, imageId, sleepTime);
+}
+
+net_state_t process_stream_V10(ResponseStream *stream, uint32_t *imageId,
+                               uint32_t *sleepTime) {
+  // v10 is v1 with an encoding per rect, black and white text is coded with
+  // Group 4
+  return process_stream_V1<encoded_rect_header_t>(stream, imageId, sleepTime);
+}
+
+#ifdef BOARD_HAS_PSRAM
+
+// Sections inflated in place only need to be committed to the framebuffer
+void draw_section(Section &section) {
+  if (!section.isInPlace()) {
+    draw_pixels(section.area, section.pixel, RECT_REPLACE);
+  } else if (!framebuffer.commit(section.area)) {
+    epd_clear_area(section.area);
+    epd_draw_image(section.area, section.pixel, BLACK_ON_WHITE);
+  }
+}
+
+bool rows_overlap(Rect_t a, Rect_t b) {
+  return a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+// Sections are inflated in pairs, the first one on the worker core while the
+// second one is received and inflated here. They are drawn in stream order.
+// Full width sections are inflated straight into the framebuffer, unless they
+// overlap the section of the worker.
+net_state_t process_stream_V11(ResponseStream *stream, uint32_t *imageId,
+                               uint32_t *sleepTime) {
+  net_state_t result = read_image_header(stream, imageId, sleepTime);
+  if (result != SUCCESS) {
+    return result;
+  }
+
+  uint32_t start = millis();
+  tinfl_decompressor *decompressor =
+      (tinfl_decompressor *)buffer_malloc(sizeof(tinfl_decompressor));
+  Section sections[2];
+  int count = 0;
+  {
+    // Stopped before the sections are released
+    SectionWorker worker;
+    while (result == SUCCESS) {
+      section_header_t header;
+      Rect_t area;
+      result = read_rect_header(stream, &header, &area);
+      if (result != SUCCESS || is_empty(area)) {
+        break;
+      }
+
+      uint8_t *target = DISPLAY_TRANSFORM == TRANSFORM_NONE
+                            ? framebuffer.getRows(area)
+                            : NULL;
+      if (count == 1 && rows_overlap(area, sections[0].area)) {
+        target = NULL;
+      }
+      Section &section = sections[count++];
+      result = check_draw_result(section.read(stream, header, area, target));
+      if (result != SUCCESS) {
+        break;
+      } else if (count == 1) {
+        worker.start(&section);
+        continue;
+      }
+
+      bool valid = section.inflate(decompressor);
+      if (!worker.wait() || !valid) {
+        result = check_draw_result(ST_DECOMPRESSION_ERROR);
+        break;
+      }
+      draw_section(sections[0]);
+      draw_section(sections[1]);
+      sections[1].release();
+      sections[0].release();
+      count = 0;
+    }
+
+    if (count == 1 && result == SUCCESS) {
+      if (worker.wait()) {
+        draw_section(sections[0]);
+      } else {
+        result = check_draw_result(ST_DECOMPRESSION_ERROR);
+      }
+    }
+  }
+  buffer_free(decompressor);
+  DBG_OUTPUT_PORT.printf("Sections decoded in %u ms\n", millis() - start);
+
+  return result == SUCCESS ? finish_image(stream) : result;
+}
+
+#else
+
+net_state_t process_stream_V11(ResponseStream *stream, uint32_t *imageId,
+                               uint32_t *sleepTime) {
+  // Without PSRAM sections are inflated one after another while they are
+  // received
+  return process_stream_V1<section_header_t>(stream, imageId, sleepTime);
+}
+
+#endif
+
+net_state_t process_stream_V12(ResponseStream *stream, uint32_t *imageId,
+                               uint32_t *sleepTime) {
+  // v12 is v2 with rects that may be sent at a lower resolution
+  return process_encoded_stream<InflateStream, scaled_rect_header_t>(
+      stream, imageId, sleepTime);
+}
+
+#ifdef BOARD_HAS_PSRAM
+
+net_state_t process_stream_V13(ResponseStream *stream, uint32_t *imageId,
+                               uint32_t *sleepTime) {
+  if (!framebuffer.isRetained()) {
+    write_error("Received transparent rects without a retained image");
+    return MISSING_FRAMEBUFFER;
+  }
+
+  // v13 is v2 with a transparent gray level per rect, only the foreground
+  // of overlays is drawn onto the retained image
+  return process_encoded_stream<InflateStream, keyed_rect_header_t>(
+      stream, imageId, sleepTime);
+}
+
+#endif
+
+net_state_t process_stream(ResponseStream *stream, uint32_t *imageId,
                            uint32_t *sleepTime) {
   uint8_t version = stream->readUint8();
   if (stream->getStatus()) {
@@ -165,8 +790,61 @@ net_state_t process_stream(HttpStream *stream, uint32_t *imageId,
       return process_stream_V1(stream, imageId, sleepTime);
     case 2:
       return process_stream_V2(stream, imageId, sleepTime);
+#ifdef BOARD_HAS_PSRAM
+    case 3:
+      return process_stream_V3(stream, imageId, sleepTime);
+#endif
+    case 4:
+      return process_stream_V4(stream, imageId, sleepTime);
+    case 5:
+      return process_stream_V5(stream, imageId, sleepTime);
+    case 6:
+      return process_stream_V6(stream, imageId, sleepTime);
+    case 7:
+      return process_stream_V7(stream, imageId, sleepTime);
+    case 8:
+      return process_stream_V8(stream, imageId, sleepTime);
+    case 9:
+      return process_stream_V9(stream, imageId, sleepTime);
+    case 10:
+      return process_stream_V10(stream, imageId, sleepTime);
+    case 11:
+      return process_stream_V11(stream, imageId, sleepTime);
+    case 12:
+      return process_stream_V12(stream, imageId, sleepTime);
+#ifdef BOARD_HAS_PSRAM
+    case 13:
+      return process_stream_V13(stream, imageId, sleepTime);
+#endif
     default:
       write_error("Unexpected schema version: " + String(version));
       return UNKOWN_VERSION;
   }
-}
\ No newline at end of file
+}
+
+// CDNs and web servers may compress the body on their own, e.g. a v1 image
+// with gzip. The content encoding is removed while the body is received,
+// before the schema version is read.
+net_state_t process_response(ResponseStream *stream, String contentEncoding,
+                             uint32_t *imageId, uint32_t *sleepTime) {
+  inflate_format_t format;
+  if (contentEncoding.length() == 0 ||
+      contentEncoding.equalsIgnoreCase("identity")) {
+    return process_stream(stream, imageId, sleepTime);
+  } else if (contentEncoding.equalsIgnoreCase("gzip") ||
+             contentEncoding.equalsIgnoreCase("x-gzip")) {
+    format = INFLATE_GZIP;
+  } else if (contentEncoding.equalsIgnoreCase("deflate")) {
+    format = INFLATE_DEFLATE;
+  } else {
+    write_error("Unsupported content encoding: " + contentEncoding);
+    return UNKNOWN_CONTENT_ENCODING;
+  }
+
+  InflateStream body(stream, format);
+  net_state_t result = process_stream(&body, imageId, sleepTime);
+  DBG_OUTPUT_PORT.printf("Content encoding %s, %u of %u bytes transferred\n",
+                         contentEncoding.c_str(), body.getCompressedSize(),
+                         body.getDecompressedSize());
+  return result;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Run-length codec of schema version 4. The payload is a sequence of blocks,
+// each starting with a control byte:
+//   0nnnnnnn  literal: n + 1 bytes follow and are copied as they are
+//   1kkkvvvv  fill: a run of bytes where both pixels have the gray level v.
+//             The run is k + 1 bytes long if k < 7, otherwise 8 + a LEB128
+//             encoded length follows.
+
+#define RLE_MAX_CONTROL_SIZE 6  // control byte and up to 5 length bytes
+
+// Parses the control block at src. Returns the number of bytes consumed or 0
+// if the block is incomplete or invalid.
+inline size_t rle_read_control(const uint8_t *src, size_t length,
+                               uint32_t *literal, uint32_t *fill,
+                               uint8_t *value) {
+  if (length == 0) {
+    return 0;
+  }
+
+  uint8_t control = src[0];
+  if (control < 0x80) {
+    *literal = control + 1;
+    return 1;
+  }
+
+  *value = (control & 0x0F) * 0x11;
+  uint32_t run = (control >> 4) & 0x07;
+  if (run < 7) {
+    *fill = run + 1;
+    return 1;
+  }
+
+  uint32_t extra = 0;
+  for (size_t i = 1; i < length && i < RLE_MAX_CONTROL_SIZE; i++) {
+    extra |= (uint32_t)(src[i] & 0x7F) << (7 * (i - 1));
+    if ((src[i] & 0x80) == 0) {
+      *fill = 8 + extra;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Writes a run with aligned 32 bit stores, the head and tail bytes of the
+// run are written one by one
+inline void rle_fill(uint8_t *dst, uint8_t value, size_t length) {
+  while (length > 0 && ((uintptr_t)dst & 3)) {
+    *dst++ = value;
+    length--;
+  }
+
+  uint32_t word = value * 0x01010101u;
+  uint32_t *words = (uint32_t *)dst;
+  for (; length >= 16; length -= 16) {
+    words[0] = word;
+    words[1] = word;
+    words[2] = word;
+    words[3] = word;
+    words += 4;
+  }
+  for (; length >= 4; length -= 4) {
+    *words++ = word;
+  }
+
+  dst = (uint8_t *)words;
+  while (length-- > 0) {
+    *dst++ = value;
+  }
+}
+
+// Decodes a complete payload that is available in memory. Returns the number
+// of bytes written to dst.
+inline size_t rle_decode(const uint8_t *src, size_t src_length, uint8_t *dst,
+                         size_t dst_length) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < src_length && out < dst_length) {
+    uint32_t literal = 0;
+    uint32_t fill = 0;
+    uint8_t value = 0;
+    size_t used =
+        rle_read_control(src + in, src_length - in, &literal, &fill, &value);
+    if (used == 0) {
+      break;
+    }
+    in += used;
+
+    if (fill > 0) {
+      size_t length = fill < dst_length - out ? fill : dst_length - out;
+      rle_fill(dst + out, value, length);
+      out += length;
+    } else {
+      size_t length = literal;
+      if (length > src_length - in) length = src_length - in;
+      if (length > dst_length - out) length = dst_length - out;
+      memcpy(dst + out, src + in, length);
+      in += length;
+      out += length;
+    }
+  }
+  return out;
+}
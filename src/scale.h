@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Integer upscaling of the rects of schema version 12. Large digits, icons
+// and gradients are sent at a fraction of their size, every pixel is repeated
+// scale times in both directions on the device. A row is expanded once and
+// then repeated, so the work is linear in the size of the output.
+
+#define SCALE_MAX 4
+
+// Repeats every pixel of a row of the given width scale times. dst needs
+// space for width * scale / 2 bytes, the width must be even.
+inline void scale_expand_row(const uint8_t *src, uint8_t *dst, int width,
+                             int scale) {
+  size_t length = width / 2;
+  switch (scale) {
+    case 2:
+      for (size_t i = 0; i < length; i++) {
+        dst[0] = (src[i] & 0x0F) * 0x11;
+        dst[1] = (src[i] >> 4) * 0x11;
+        dst += 2;
+      }
+      break;
+    case 3:
+      // Two pixels become three bytes, the middle one holds both
+      for (size_t i = 0; i < length; i++) {
+        dst[0] = (src[i] & 0x0F) * 0x11;
+        dst[1] = src[i];
+        dst[2] = (src[i] >> 4) * 0x11;
+        dst += 3;
+      }
+      break;
+    case 4:
+      for (size_t i = 0; i < length; i++) {
+        uint8_t low = (src[i] & 0x0F) * 0x11;
+        uint8_t high = (src[i] >> 4) * 0x11;
+        dst[0] = low;
+        dst[1] = low;
+        dst[2] = high;
+        dst[3] = high;
+        dst += 4;
+      }
+      break;
+    default:
+      memcpy(dst, src, length);
+      break;
+  }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed size headers of the schema (see docs/Schema.md). Every struct mirrors
+// the byte layout in the stream, so a header is read with a single bulk read
+// and validated with a single status check instead of one read per field.
+// A new schema version only needs a new header struct with its fields.
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Schema headers are read directly into memory, little endian required"
+#endif
+
+// Follows the version byte
+struct __attribute__((packed)) image_header_t {
+  uint32_t image_id;
+  uint32_t sleep_time;
+};
+
+struct __attribute__((packed)) rect_header_t {
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+
+// Rect headers per pixel encoding, they start with the common rect fields
+
+// Versions 1 to 4 and 7
+struct __attribute__((packed)) raw_rect_header_t {
+  rect_header_t rect;
+};
+
+// Version 5
+struct __attribute__((packed)) tiled_rect_header_t {
+  rect_header_t rect;
+  uint8_t tile_size;
+};
+
+// Version 6, the palette entries follow the header
+struct __attribute__((packed)) indexed_rect_header_t {
+  rect_header_t rect;
+  uint8_t bpp;
+  uint8_t palette_size;
+};
+
+// Version 8, a PNG file with the pixels of the rect follows the header
+struct __attribute__((packed)) png_rect_header_t {
+  rect_header_t rect;
+};
+
+// Version 9, flags select how the pixel data is laid out
+#define RECT_FLAG_BIT_PLANES 0x01  // rows are sent as four bit planes
+
+struct __attribute__((packed)) planar_rect_header_t {
+  rect_header_t rect;
+  uint8_t flags;
+};
+
+// Version 10, the encoding selects the codec of the length bytes that follow
+typedef enum {
+  RECT_ENCODING_RAW = 0,  // nibbles as in version 1
+  RECT_ENCODING_G4 = 1,   // Group 4 coded black and white pixels, see g4.h
+} rect_encoding_t;
+
+struct __attribute__((packed)) encoded_rect_header_t {
+  rect_header_t rect;
+  uint8_t encoding;
+  uint32_t length;
+};
+
+// Version 11, the pixels of the rect follow as a zlib stream of length bytes.
+// Every section is compressed on its own, so sections can be inflated in
+// parallel or skipped without inflating them.
+struct __attribute__((packed)) section_header_t {
+  rect_header_t rect;
+  uint32_t length;
+};
+
+// Version 12, the pixels of the rect are sent at 1 / scale of its width and
+// height and repeated scale times in both directions
+struct __attribute__((packed)) scaled_rect_header_t {
+  rect_header_t rect;
+  uint8_t scale;
+};
+
+// Version 13, pixels of the key level are transparent
+#define RECT_KEY_OPAQUE 0xFF  // the rect has no transparent level
+
+struct __attribute__((packed)) keyed_rect_header_t {
+  rect_header_t rect;
+  uint8_t key;
+};
+
+static_assert(sizeof(image_header_t) == 8, "image header layout");
+static_assert(offsetof(image_header_t, sleep_time) == 4, "image header layout");
+static_assert(sizeof(rect_header_t) == 8, "rect header layout");
+static_assert(offsetof(rect_header_t, height) == 6, "rect header layout");
+static_assert(sizeof(raw_rect_header_t) == 8, "raw rect header layout");
+static_assert(sizeof(png_rect_header_t) == 8, "png rect header layout");
+static_assert(sizeof(planar_rect_header_t) == 9, "planar rect header layout");
+static_assert(offsetof(encoded_rect_header_t, length) == 9,
+              "encoded rect header layout");
+static_assert(sizeof(section_header_t) == 12, "section header layout");
+static_assert(sizeof(scaled_rect_header_t) == 9, "scaled rect header layout");
+static_assert(sizeof(keyed_rect_header_t) == 9, "keyed rect header layout");
+static_assert(sizeof(tiled_rect_header_t) == 9, "tiled rect header layout");
+static_assert(offsetof(indexed_rect_header_t, bpp) == 8,
+              "indexed rect header layout");
+static_assert(sizeof(indexed_rect_header_t) == 10,
+              "indexed rect header layout");
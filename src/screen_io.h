@@ -2,6 +2,7 @@
 
 #include <Arduino.h>
 
+#include "allocation.h"
 #include "epd_driver.h"
 #include "opensans16.h"
 
@@ -42,8 +43,9 @@ void write_error(String string, bool clearArea) {
       .height = 100,
   };
 
+#ifdef BOARD_HAS_PSRAM
   uint8_t *framebuffer =
-      (uint8_t *)ps_calloc(sizeof(uint8_t), area.height * area.width / 2);
+      (uint8_t *)buffer_malloc(area.height * area.width / 2);
   memset(framebuffer, 0xFF, area.height * area.width / 2);
 
   epd_draw_rect(30, 20, area.width - 70, 60, 0, framebuffer);
@@ -58,7 +60,19 @@ void write_error(String string, bool clearArea) {
   }
 
   epd_draw_grayscale_image(area, framebuffer);
-  free(framebuffer);
+  buffer_free(framebuffer);
+#else
+  // Without PSRAM there is no space for a framebuffer of the banner, the text
+  // is written directly onto the display instead
+  epd_poweron();
+  if (clearArea) {
+    epd_clear_area(area);
+  }
+
+  int x = 50;
+  int y = area.y + 65;
+  writeln((GFXfont *)&OpenSans16, (char *)string.c_str(), &x, &y, NULL);
+#endif
 
   epd_poweroff();
   Serial.println(string);
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <Arduino.h>
+#include <miniz.h>
+
+#include <atomic>
+
+#include "allocation.h"
+#include "epd_driver.h"
+#include "schema.h"
+#include "stream.cpp"
+
+// Sections of schema version 11 are independent zlib streams of one rect each.
+// With PSRAM a section is read into memory completely, so it can be inflated
+// straight into its pixel buffer on either core: the worker task inflates one
+// section on SECTION_WORKER_CORE while the calling task receives and inflates
+// the next one.
+#define SECTION_WORKER_CORE 0
+#define SECTION_WORKER_STACK_SIZE 4096
+
+// Inflates a complete zlib stream into a buffer of exactly the output size.
+// The output is not wrapping, so no dictionary window is needed. For the same
+// reason preset dictionaries are not supported, tinfl rejects FDICT headers.
+inline bool inflate_section(tinfl_decompressor* decompressor,
+                            const uint8_t* input, size_t input_size,
+                            uint8_t* output, size_t output_size) {
+  tinfl_init(decompressor);
+  size_t in_bytes = input_size;
+  size_t out_bytes = output_size;
+  tinfl_status result = tinfl_decompress(
+      decompressor, input, &in_bytes, output, output, &out_bytes,
+      TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  return result == TINFL_STATUS_DONE && out_bytes == output_size;
+}
+
+// A section read into memory. Buffers are taken from the arena by the calling
+// task, the arena must not be used by the worker.
+class Section {
+ private:
+  bool owns_pixel = false;
+
+ public:
+  Rect_t area;
+  uint8_t* input = NULL;
+  size_t input_size = 0;
+  uint8_t* pixel = NULL;
+  size_t pixel_size = 0;
+
+  // The pixels are inflated into target if it is given, e.g. the final
+  // location in the framebuffer, otherwise into a buffer of their own
+  st_status read(ResponseStream* stream, const section_header_t& header,
+                 Rect_t rect, uint8_t* target = NULL) {
+    area = rect;
+    input_size = header.length;
+    pixel_size = (uint32_t)area.width * area.height / 2;
+    input = (uint8_t*)buffer_malloc(input_size);
+    owns_pixel = target == NULL;
+    pixel = owns_pixel ? (uint8_t*)buffer_malloc(pixel_size) : target;
+    stream->readBytes(input, input_size);
+    return stream->getStatus();
+  }
+
+  bool isInPlace() { return pixel != NULL && !owns_pixel; }
+
+  bool inflate(tinfl_decompressor* decompressor) {
+    return inflate_section(decompressor, input, input_size, pixel, pixel_size);
+  }
+
+  void release() {
+    if (owns_pixel) {
+      buffer_free(pixel);
+    }
+    buffer_free(input);
+    pixel = NULL;
+    input = NULL;
+  }
+
+  ~Section() { release(); }
+};
+
+// Inflates one section at a time on a task pinned to SECTION_WORKER_CORE. The
+// task is stopped when the worker goes out of scope, sections handed to it
+// must outlive the worker. If the task cannot be created, sections are
+// inflated on the calling task instead.
+class SectionWorker {
+ private:
+  tinfl_decompressor* decompressor;
+  TaskHandle_t worker_task = NULL;
+  TaskHandle_t consumer_task;
+  Section* section = NULL;
+  bool running = false;
+  bool result = false;
+  std::atomic<bool> busy{false};
+  std::atomic<bool> stopped{false};
+  std::atomic<bool> worker_finished{false};
+
+  static void workerTask(void* parameter) {
+    SectionWorker* worker = (SectionWorker*)parameter;
+    TaskHandle_t consumer_task = worker->consumer_task;
+    while (!worker->stopped) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      if (worker->busy) {
+        worker->result = worker->section->inflate(worker->decompressor);
+        worker->busy = false;
+        xTaskNotifyGive(consumer_task);
+      }
+    }
+
+    // The worker may be released as soon as the flag is set
+    worker->worker_finished = true;
+    xTaskNotifyGive(consumer_task);
+    vTaskDelete(NULL);
+  }
+
+ public:
+  SectionWorker() {
+    consumer_task = xTaskGetCurrentTaskHandle();
+    decompressor =
+        (tinfl_decompressor*)buffer_malloc(sizeof(tinfl_decompressor));
+    running = xTaskCreatePinnedToCore(workerTask, "inflate",
+                                      SECTION_WORKER_STACK_SIZE, this, 1,
+                                      &worker_task,
+                                      SECTION_WORKER_CORE) == pdPASS;
+    if (!running) {
+      Serial.println("Could not create inflate task, decoding sequentially");
+    }
+  }
+
+  // Starts inflating the section, the previous one must have been waited for
+  void start(Section* next) {
+    section = next;
+    if (!running) {
+      result = section->inflate(decompressor);
+      return;
+    }
+    busy = true;
+    xTaskNotifyGive(worker_task);
+  }
+
+  // Waits until the section is inflated, returns false if it is invalid
+  bool wait() {
+    while (busy) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+    return result;
+  }
+
+  ~SectionWorker() {
+    if (running) {
+      wait();
+      stopped = true;
+      xTaskNotifyGive(worker_task);
+      while (!worker_finished) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+      }
+    }
+    buffer_free(decompressor);
+  }
+};
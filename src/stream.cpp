@@ -1,27 +1,74 @@
+#pragma once
+
 #include <Arduino.h>
 #include <Stream.h>
 #include <miniz.h>
 #include <stddef.h>
 
-#define MAX_SIZE 1024 * 500  // 500 KB
+#include <functional>
+
+#include "allocation.h"
+#include "lz4.h"
+#include "png.h"
+#include "rle.h"
+
+#define DECODER_INPUT_SIZE 4096
+
+// How often a dropped connection is reopened with a range request before the
+// download is given up
+#ifndef HTTP_RESUME_ATTEMPTS
+#define HTTP_RESUME_ATTEMPTS 3
+#endif
+#define HTTP_RESUME_DELAY 500  // ms, multiplied with the attempt
+
+// Read timeouts follow the measured throughput, a read may take
+// HTTP_TIMEOUT_FACTOR times as long as expected within these bounds
+#define HTTP_MIN_TIMEOUT 1000   // ms
+#define HTTP_MAX_TIMEOUT 15000  // ms
+#define HTTP_TIMEOUT_FACTOR 4
+
+// The download is aborted if the throughput stays below this floor for a
+// whole window of time spent waiting for the network
+#ifndef HTTP_MIN_THROUGHPUT
+#define HTTP_MIN_THROUGHPUT 512  // bytes per second
+#endif
+#define HTTP_THROUGHPUT_WINDOW 3000  // ms
+
+// Bytes of the socket read ahead of the parser. Small reads, e.g. rect headers
+// or chunk sizes, are served from memory instead of one TLS read each. Reads
+// of at least this size go to the socket directly.
+#ifndef HTTP_READ_AHEAD_SIZE
+#define HTTP_READ_AHEAD_SIZE 4096
+#endif
 
 enum {
   ST_OK = 0,
   ST_STREAM_END = 1,
   ST_STREAM_END_UNEXPECTED = 2,
   ST_TOO_LARGE = 3,
-  ST_DECOMPRESSION_ERROR = 4
+  ST_DECOMPRESSION_ERROR = 4,
+  ST_CHECKSUM_ERROR = 5,
+  ST_PROTOCOL_ERROR = 6,
+  ST_TIMEOUT = 7,
+  ST_TOO_SLOW = 8
 } typedef st_status;
 
 class ResponseStream {
  protected:
   st_status status = ST_OK;
-  virtual size_t readBytesRaw(uint8_t* buffer, size_t length);
+  virtual size_t readBytesRaw(uint8_t* buffer, size_t length) = 0;
+
+  // Streams that keep the next bytes in memory hand them out without copying
+  virtual size_t borrowRaw(const uint8_t** data, size_t length) { return 0; }
 
  public:
+  virtual ~ResponseStream() {}
+
   size_t readBytes(uint8_t* buffer, size_t length) {
     size_t size = readBytesRaw(buffer, length);
-    if (size == 0) {
+    if (status > ST_STREAM_END_UNEXPECTED) {
+      // The stream implementation already reported a more specific error
+    } else if (size == 0) {
       status = ST_STREAM_END;
     } else if (size < length) {
       status = ST_STREAM_END_UNEXPECTED;
@@ -29,8 +76,35 @@ class ResponseStream {
     return size;
   }
 
+  // True if borrow() is supported
+  virtual bool canBorrow() { return false; }
+
+  // Zero-copy read of up to length bytes, *data points into the stream. The
+  // bytes are consumed and stay valid until the next call on the stream.
+  // Fewer bytes than requested are returned at internal block borders.
+  size_t borrow(const uint8_t** data, size_t length) {
+    size_t size = borrowRaw(data, length);
+    if (size == 0 && status <= ST_STREAM_END_UNEXPECTED) {
+      status = ST_STREAM_END;
+    }
+    return size;
+  }
+
   st_status getStatus() { return status; }
 
+  // Number of bytes left in the stream or -1 if unknown
+  virtual long getExpectedRemainingSize() { return -1; }
+
+  // Called after the parser reached the end of the payload. Consumes what is
+  // left of the body and returns ST_OK if it arrived completely and intact.
+  virtual st_status finish() { return status > ST_STREAM_END ? status : ST_OK; }
+
+  // Reads a fixed size header of the schema (see schema.h) in a single call
+  template <typename T>
+  void readHeader(T* header) {
+    readBytes((uint8_t*)header, sizeof(T));
+  }
+
   void readUint8(uint8_t* value) { readBytes(value, 1); }
 
   uint8_t readUint8() {
@@ -56,34 +130,343 @@ class ResponseStream {
   }
 };
 
+// Function that requests the body again starting at the given offset. Returns
+// NULL if the server cannot continue the body.
+typedef std::function<Stream*(size_t offset)> reopen_function_t;
+
 class HttpStream : public ResponseStream {
  private:
   Stream* stream;
   int expectedSize;
+  size_t received = 0;
+
+  reopen_function_t reopen;
+  int resume_attempts = 0;
+
+  // Only the time spent waiting in reads counts for the throughput, not the
+  // time spent drawing between them
+  unsigned long read_time = 0;
+  uint32_t window_bytes = 0;
+  unsigned long window_time = 0;
+  bool timed_out = false;
+
+  // Adler-32 of the body, the server sends it as trailer after the payload
+  bool checksum_enabled = false;
+  bool checksum_failed = false;
+  uint32_t checksum = MZ_ADLER32_INIT;
+  uint8_t trailer[4];
+  size_t trailer_size = 0;
+
+  // Chunked transfer encoding, the body has no content length and ends with
+  // a chunk of size 0
+  bool chunked = false;
+  bool last_chunk = false;
+  uint32_t chunk_remaining = 0;
+  uint32_t chunk_count = 0;
+
+  // Bytes read from the socket but not yet consumed
+  uint8_t* read_ahead;
+  size_t ahead_offset = 0;
+  size_t ahead_size = 0;
+  uint32_t socket_reads = 0;
+
+  // Reads from the read-ahead buffer and refills it with at least the missing
+  // bytes, plus whatever the socket already has, e.g. the rest of a TLS
+  // record. Only the missing bytes are waited for.
+  size_t readSocket(uint8_t* buffer, size_t length) {
+    size_t size = min(length, ahead_size - ahead_offset);
+    memcpy(buffer, read_ahead + ahead_offset, size);
+    ahead_offset += size;
+    if (size == length) {
+      return size;
+    }
+
+    size_t missing = length - size;
+    socket_reads++;
+    if (missing >= HTTP_READ_AHEAD_SIZE) {
+      return size + stream->readBytes(buffer + size, missing);
+    }
+
+    int available = stream->available();
+    size_t fill = max(missing, min((size_t)max(available, 0),
+                                   (size_t)HTTP_READ_AHEAD_SIZE));
+    ahead_offset = 0;
+    ahead_size = stream->readBytes(read_ahead, fill);
+    size_t chunk = min(missing, ahead_size);
+    memcpy(buffer + size, read_ahead, chunk);
+    ahead_offset = chunk;
+    return size + chunk;
+  }
+
+  // Reopens the connection at the current offset if it dropped before the
+  // announced end of the body
+  bool resume() {
+    if (!reopen || expectedSize < 0 ||
+        resume_attempts >= HTTP_RESUME_ATTEMPTS) {
+      return false;
+    }
+    resume_attempts++;
+    Serial.printf("Connection dropped after %u bytes, resuming (%d/%d)\n",
+                  received, resume_attempts, HTTP_RESUME_ATTEMPTS);
+    delay(HTTP_RESUME_DELAY * resume_attempts);
+
+    Stream* resumed = reopen(received);
+    if (resumed == NULL) {
+      return false;
+    }
+    // A short read left nothing in the read-ahead buffer, so the body
+    // continues at the received offset
+    stream = resumed;
+    ahead_offset = 0;
+    ahead_size = 0;
+    return true;
+  }
+
+  unsigned long readTimeout(size_t length) {
+    uint64_t rate = HTTP_MIN_THROUGHPUT;
+    if (received > 0) {
+      rate = max(rate, (uint64_t)received * 1000 / max(read_time, 1UL));
+    }
+    uint64_t timeout = (uint64_t)length * 1000 * HTTP_TIMEOUT_FACTOR / rate;
+    return min(max(timeout, (uint64_t)HTTP_MIN_TIMEOUT),
+               (uint64_t)HTTP_MAX_TIMEOUT);
+  }
+
+  // Returns false if a full window was below the throughput floor
+  bool measure(size_t bytes, unsigned long duration) {
+    read_time += duration;
+    window_bytes += bytes;
+    window_time += duration;
+    if (window_time < HTTP_THROUGHPUT_WINDOW) {
+      return true;
+    }
+
+    uint32_t throughput = (uint64_t)window_bytes * 1000 / window_time;
+    window_bytes = 0;
+    window_time = 0;
+    if (throughput < HTTP_MIN_THROUGHPUT) {
+      Serial.printf("Throughput of %u B/s is below %u B/s, aborting\n",
+                    throughput, HTTP_MIN_THROUGHPUT);
+      status = ST_TOO_SLOW;
+      return false;
+    }
+    return true;
+  }
+
+  size_t receive(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    do {
+      unsigned long timeout = readTimeout(length - size);
+      stream->setTimeout(timeout);
+      unsigned long start = millis();
+      size_t chunk = readSocket(buffer + size, length - size);
+      unsigned long duration = millis() - start;
+
+      size += chunk;
+      received += chunk;
+      timed_out = size < length && duration >= timeout;
+      if (!measure(chunk, duration)) {
+        break;
+      }
+    } while (size < length && resume());
+    return size;
+  }
+
+  // Parses the size line of the next chunk: "<hex size>[;extension]\r\n"
+  bool readChunkHeader() {
+    uint8_t c;
+    if (chunk_count > 0) {
+      // Line break after the data of the previous chunk
+      uint8_t line_break[2];
+      if (readSocket(line_break, 2) < 2) {
+        return false;
+      } else if (line_break[0] != '\r' || line_break[1] != '\n') {
+        Serial.println("Invalid chunk delimiter");
+        status = ST_PROTOCOL_ERROR;
+        return false;
+      }
+    }
+
+    uint32_t size = 0;
+    int digits = 0;
+    bool extension = false;
+    while (true) {
+      if (readSocket(&c, 1) < 1) {
+        return false;
+      } else if (c == '\n') {
+        break;
+      } else if (extension || c == '\r') {
+        continue;
+      } else if (c == ';' || c == ' ') {
+        extension = true;
+      } else if (isxdigit(c) && digits < 8) {
+        size = size * 16 + (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+        digits++;
+      } else {
+        digits = 0;
+        break;
+      }
+    }
+
+    if (digits == 0) {
+      Serial.println("Invalid chunk size");
+      status = ST_PROTOCOL_ERROR;
+      return false;
+    }
+    chunk_count++;
+    chunk_remaining = size;
+    last_chunk = size == 0;
+    return true;
+  }
+
+  // Reads the payload of the chunks and skips their framing. Stops right
+  // after the last chunk instead of waiting for the read timeout.
+  size_t receiveChunked(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    while (size < length && !last_chunk) {
+      if (chunk_remaining == 0 && !readChunkHeader()) {
+        break;
+      }
+
+      size_t chunk = min(length - size, (size_t)chunk_remaining);
+      size_t read = receive(buffer + size, chunk);
+      size += read;
+      chunk_remaining -= read;
+      if (read < chunk) {
+        break;
+      }
+    }
+    return size;
+  }
+
+  // Without a content length the trailer is only known after the last chunk,
+  // so the last 4 bytes received are always held back
+  size_t receiveHoldingTrailer(uint8_t* buffer, size_t length) {
+    if (trailer_size < 4) {
+      trailer_size +=
+          receiveChunked(trailer + trailer_size, 4 - trailer_size);
+      if (trailer_size < 4) {
+        return 0;
+      }
+    }
+
+    size_t size = receiveChunked(buffer, length);
+    uint8_t held[4];
+    if (size >= 4) {
+      memcpy(held, buffer + size - 4, 4);
+      memmove(buffer + 4, buffer, size - 4);
+      memcpy(buffer, trailer, 4);
+    } else {
+      memcpy(held, trailer + size, 4 - size);
+      memcpy(held + 4 - size, buffer, size);
+      memcpy(buffer, trailer, size);
+    }
+    memcpy(trailer, held, 4);
+    return size;
+  }
+
+  void verifyChecksum() {
+    uint32_t expected;
+    if (chunked) {
+      memcpy(&expected, trailer, 4);
+    } else {
+      trailer_size = receive((uint8_t*)&expected, 4);
+    }
+    if (trailer_size < 4 || expected != checksum) {
+      Serial.printf("Checksum mismatch: %08x != %08x\n", checksum, expected);
+      checksum_failed = true;
+    }
+    checksum_enabled = false;
+  }
 
  protected:
   size_t readBytesRaw(uint8_t* buffer, size_t length) {
-    if (expectedSize > 0) expectedSize -= length;
+    if (status == ST_TOO_SLOW) {
+      return 0;
+    }
+    if (expectedSize >= 0 && length > (size_t)expectedSize) {
+      // Never read into the trailer or wait for bytes that will not come
+      length = expectedSize;
+    }
 
-    if (length > 10000) {
-      // Increase timeout for large payloads
-      stream->setTimeout(15000);
+    size_t size;
+    if (chunked && checksum_enabled) {
+      size = receiveHoldingTrailer(buffer, length);
+    } else if (chunked) {
+      size = receiveChunked(buffer, length);
     } else {
-      stream->setTimeout(1000);
+      size = receive(buffer, length);
     }
-    return stream->readBytes(buffer, length);
+
+    if (size < length && timed_out && (expectedSize >= 0 || chunked) &&
+        status <= ST_STREAM_END_UNEXPECTED) {
+      // The body continues, but the server stopped sending
+      status = ST_TIMEOUT;
+    }
+
+    if (checksum_enabled) {
+      checksum = mz_adler32(checksum, buffer, size);
+    }
+    if (expectedSize > 0) expectedSize -= size;
+    if (checksum_enabled && (expectedSize == 0 || (chunked && last_chunk))) {
+      verifyChecksum();
+    }
+    return size;
   }
 
  public:
-  HttpStream(Stream* stream, int expectedSize)
-      : stream(stream), expectedSize(expectedSize) {
+  HttpStream(Stream* stream, int expectedSize,
+             reopen_function_t reopen = NULL)
+      : stream(stream), expectedSize(expectedSize), reopen(reopen) {
     Serial.println(String("Creation Size: " + String(expectedSize)).c_str());
+    read_ahead = (uint8_t*)buffer_malloc(HTTP_READ_AHEAD_SIZE);
+  }
+  HttpStream(Stream* stream) : stream(stream), expectedSize(-1) {
+    read_ahead = (uint8_t*)buffer_malloc(HTTP_READ_AHEAD_SIZE);
   }
-  HttpStream(Stream* stream) : stream(stream), expectedSize(-1) {}
 
-  size_t getExpectedRemainingSize() {
-    Serial.println(String("Ex Size: " + String(expectedSize)).c_str());
-    return expectedSize;
+  ~HttpStream() { buffer_free(read_ahead); }
+
+  long getExpectedRemainingSize() {
+    return chunked && last_chunk ? 0 : expectedSize;
+  }
+
+  // The body is sent with "Transfer-Encoding: chunked"
+  void enableChunkedTransfer() {
+    chunked = true;
+    expectedSize = -1;
+  }
+
+  // The last 4 bytes of the body are the Adler-32 of the payload before them
+  // in little endian
+  void enableChecksum() {
+    if (!chunked) {
+      if (expectedSize < 4) {
+        return;
+      }
+      expectedSize -= 4;
+    }
+    checksum_enabled = true;
+  }
+
+  st_status finish() {
+    // Skip bytes the parser did not need, e.g. the trailer of a zlib stream
+    uint8_t skipped[64];
+    while (expectedSize > 0 &&
+           readBytes(skipped, min((size_t)expectedSize, sizeof(skipped)))) {
+    }
+    while (chunked && !last_chunk && readBytes(skipped, sizeof(skipped))) {
+    }
+    Serial.printf("Received %u bytes in %u socket reads\n", received,
+                  socket_reads);
+
+    if (status > ST_STREAM_END_UNEXPECTED) {
+      return status;
+    } else if (expectedSize > 0 || (chunked && !last_chunk)) {
+      return ST_STREAM_END_UNEXPECTED;
+    }
+    // Without a content length a short read is the regular end of the body
+    return checksum_failed ? ST_CHECKSUM_ERROR : ST_OK;
   }
 };
 
@@ -100,6 +483,783 @@ class BufferedStream : public ResponseStream {
     return real_length;
   }
 
+  size_t borrowRaw(const uint8_t** data, size_t length) {
+    size_t real_length = min(length, memory_size - offset);
+    *data = memory + offset;
+    offset += real_length;
+    return real_length;
+  }
+
  public:
   BufferedStream(uint8_t* data, int size) : memory(data), memory_size(size) {}
+
+  bool canBorrow() { return true; }
+};
+
+// Hands out the next length bytes of the source, e.g. a length prefixed
+// section. Decoders on top of it do not read past its end.
+class LimitedStream : public ResponseStream {
+ private:
+  ResponseStream* source;
+  size_t remaining;
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    size_t size = source->readBytes(buffer, min(length, remaining));
+    remaining -= size;
+    if (source->getStatus() > ST_STREAM_END_UNEXPECTED) {
+      status = source->getStatus();
+    }
+    return size;
+  }
+
+  size_t borrowRaw(const uint8_t** data, size_t length) {
+    size_t size = remaining > 0 ? source->borrow(data, min(length, remaining))
+                                : 0;
+    remaining -= size;
+    if (source->getStatus() > ST_STREAM_END_UNEXPECTED) {
+      status = source->getStatus();
+    }
+    return size;
+  }
+
+ public:
+  LimitedStream(ResponseStream* source, size_t length)
+      : source(source), remaining(length) {}
+
+  bool canBorrow() { return source->canBorrow(); }
+
+  long getExpectedRemainingSize() { return remaining; }
+
+  // Skips the bytes the decoder did not consume
+  st_status finish() {
+    uint8_t scratch[64];
+    while (remaining > 0 &&
+           readBytes(scratch, min(remaining, sizeof(scratch))) > 0) {
+    }
+    if (status > ST_STREAM_END_UNEXPECTED) {
+      return status;
+    }
+    return remaining > 0 ? ST_STREAM_END_UNEXPECTED : ST_OK;
+  }
+};
+
+// Base for streams that decode the bytes of a source stream. The encoded
+// bytes are read block wise into an input buffer.
+class DecoderStream : public ResponseStream {
+ protected:
+  ResponseStream* source;
+
+  // Encoded bytes read from the source but not yet consumed by the decoder
+  uint8_t* input;
+  size_t input_offset = 0;
+  size_t input_size = 0;
+  bool source_finished = false;
+
+  size_t compressed_size = 0;
+  size_t decompressed_size = 0;
+
+  // Reads the next block from the source, bytes that were not consumed yet
+  // are moved to the front of the input buffer
+  void fillInput() {
+    size_t pending = input_size - input_offset;
+    memmove(input, input + input_offset, pending);
+    input_offset = 0;
+    input_size = pending;
+
+    size_t length = DECODER_INPUT_SIZE - pending;
+    long remaining = source->getExpectedRemainingSize();
+    if (remaining == 0) {
+      source_finished = true;
+      return;
+    } else if (remaining > 0 && remaining < (long)length) {
+      length = remaining;
+    }
+
+    size_t size = source->readBytes(input + pending, length);
+    input_size += size;
+    compressed_size += size;
+    if (size < length) {
+      source_finished = true;
+    }
+  }
+
+  // Returns false if the source ends before length bytes are in the input
+  // buffer
+  bool ensureInput(size_t length) {
+    if (input_size - input_offset < length && !source_finished) {
+      fillInput();
+    }
+    return input_size - input_offset >= length;
+  }
+
+ public:
+  DecoderStream(ResponseStream* source) : source(source) {
+    input = (uint8_t*)buffer_malloc(DECODER_INPUT_SIZE);
+  }
+
+  ~DecoderStream() { buffer_free(input); }
+
+  st_status finish() {
+    return status > ST_STREAM_END_UNEXPECTED ? status : source->finish();
+  }
+
+  size_t getCompressedSize() { return compressed_size; }
+
+  size_t getDecompressedSize() { return decompressed_size; }
+};
+
+// Copies the preset dictionary with the given zlib id into dst and returns its
+// size, 0 if the dictionary is not known
+typedef std::function<size_t(uint32_t id, uint8_t* dst, size_t size)>
+    dictionary_loader_t;
+
+dictionary_loader_t inflate_dictionary_loader = NULL;
+
+#define ZLIB_HEADER_SIZE 2
+#define ZLIB_FLAG_FDICT 0x20
+#define ZLIB_DICTIONARY_ID_SIZE 4
+#define ZLIB_TRAILER_SIZE 4
+
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8  // CRC-32 and size of the output
+#define GZIP_FLAG_FHCRC 0x02
+#define GZIP_FLAG_FEXTRA 0x04
+#define GZIP_FLAG_FNAME 0x08
+#define GZIP_FLAG_FCOMMENT 0x10
+
+typedef enum {
+  INFLATE_ZLIB = 0,     // payloads of the schema versions
+  INFLATE_GZIP = 1,     // HTTP content encoding gzip
+  INFLATE_DEFLATE = 2,  // HTTP content encoding deflate, zlib or raw
+  INFLATE_RAW = 3,      // deflate data without header and trailer
+} inflate_format_t;
+
+// Decompresses a zlib, gzip or raw deflate stream while it is read from the
+// source stream. Only the 32 KB dictionary window of the deflate algorithm is
+// kept in memory, therefore the size of the payload is not limited by the
+// available memory.
+class InflateStream : public DecoderStream {
+ private:
+  tinfl_decompressor* decompressor;
+  tinfl_status inflate_status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+  // tinfl only parses plain zlib headers. For preset dictionaries (FDICT),
+  // gzip and raw deflate the header and trailer are handled here and the
+  // deflate data is inflated raw.
+  inflate_format_t format;
+  bool header_checked = false;
+  bool raw = false;
+  uint32_t checksum = MZ_ADLER32_INIT;
+
+  // Wrapping output window, decompressed bytes are handed out directly from
+  // here before tinfl overwrites them with the next block
+  uint8_t* dictionary;
+  size_t dictionary_offset = 0;
+  size_t output_offset = 0;
+  size_t output_size = 0;
+
+  bool fail(const char* message) {
+    Serial.println(message);
+    status = ST_DECOMPRESSION_ERROR;
+    return false;
+  }
+
+  bool skipInput(size_t length) {
+    while (length > 0) {
+      if (!ensureInput(1)) {
+        return false;
+      }
+      size_t chunk = min(length, input_size - input_offset);
+      input_offset += chunk;
+      length -= chunk;
+    }
+    return true;
+  }
+
+  // Skips a zero terminated string
+  bool skipString() {
+    while (ensureInput(1)) {
+      if (input[input_offset++] == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool isZlibHeader(const uint8_t* header) {
+    return (header[0] * 256 + header[1]) % 31 == 0 && (header[0] & 0x0F) == 8;
+  }
+
+  bool checkHeader() {
+    header_checked = true;
+    switch (format) {
+      case INFLATE_GZIP:
+        return checkGzipHeader();
+      case INFLATE_DEFLATE:
+        // Some servers send raw deflate data instead of a zlib stream
+        if (ensureInput(ZLIB_HEADER_SIZE) &&
+            isZlibHeader(input + input_offset)) {
+          format = INFLATE_ZLIB;
+          return checkZlibHeader();
+        }
+        format = INFLATE_RAW;
+        raw = true;
+        return true;
+      case INFLATE_RAW:
+        raw = true;
+        return true;
+      default:
+        return checkZlibHeader();
+    }
+  }
+
+  // Loads the preset dictionary if the zlib header names one, other headers
+  // are left to tinfl
+  bool checkZlibHeader() {
+    if (!ensureInput(ZLIB_HEADER_SIZE) ||
+        !(input[input_offset + 1] & ZLIB_FLAG_FDICT)) {
+      return true;
+    }
+
+    const uint8_t* header = input + input_offset;
+    if (!isZlibHeader(header) ||
+        !ensureInput(ZLIB_HEADER_SIZE + ZLIB_DICTIONARY_ID_SIZE)) {
+      return fail("Invalid zlib header");
+    }
+
+    header = input + input_offset;
+    uint32_t id = (uint32_t)header[2] << 24 | header[3] << 16 |
+                  header[4] << 8 | header[5];
+    size_t size = inflate_dictionary_loader != NULL
+                      ? inflate_dictionary_loader(id, dictionary,
+                                                  TINFL_LZ_DICT_SIZE)
+                      : 0;
+    if (size == 0) {
+      Serial.printf("Unknown preset dictionary %08x\n", id);
+      status = ST_DECOMPRESSION_ERROR;
+      return false;
+    }
+
+    Serial.printf("Preset dictionary %08x, %u bytes\n", id, size);
+    input_offset += ZLIB_HEADER_SIZE + ZLIB_DICTIONARY_ID_SIZE;
+    dictionary_offset = size & (TINFL_LZ_DICT_SIZE - 1);
+    raw = true;
+    checksum = MZ_ADLER32_INIT;
+    return true;
+  }
+
+  // The gzip header may carry optional fields like the file name, none of
+  // them is needed
+  bool checkGzipHeader() {
+    if (!ensureInput(GZIP_HEADER_SIZE)) {
+      return fail("gzip header is missing");
+    }
+    const uint8_t* header = input + input_offset;
+    if (header[0] != 0x1F || header[1] != 0x8B || header[2] != 8) {
+      return fail("Invalid gzip header");
+    }
+
+    uint8_t flags = header[3];
+    input_offset += GZIP_HEADER_SIZE;
+    if (flags & GZIP_FLAG_FEXTRA) {
+      if (!ensureInput(2)) {
+        return fail("Invalid gzip header");
+      }
+      size_t length = input[input_offset] | input[input_offset + 1] << 8;
+      input_offset += 2;
+      if (!skipInput(length)) {
+        return fail("Invalid gzip header");
+      }
+    }
+    if (((flags & GZIP_FLAG_FNAME) && !skipString()) ||
+        ((flags & GZIP_FLAG_FCOMMENT) && !skipString()) ||
+        ((flags & GZIP_FLAG_FHCRC) && !skipInput(2))) {
+      return fail("Invalid gzip header");
+    }
+
+    raw = true;
+    checksum = MZ_CRC32_INIT;
+    return true;
+  }
+
+  void updateChecksum(const uint8_t* data, size_t length) {
+    if (format == INFLATE_GZIP) {
+      checksum = mz_crc32(checksum, data, length);
+    } else if (format == INFLATE_ZLIB) {
+      checksum = mz_adler32(checksum, data, length);
+    }
+  }
+
+  // The checksum of the output follows the deflate data, Adler-32 in big
+  // endian for zlib, CRC-32 and the output size in little endian for gzip
+  bool checkTrailer() {
+    if (format == INFLATE_RAW) {
+      return true;
+    }
+
+    size_t size =
+        format == INFLATE_GZIP ? GZIP_TRAILER_SIZE : ZLIB_TRAILER_SIZE;
+    if (!ensureInput(size)) {
+      return fail("Checksum trailer is missing");
+    }
+    const uint8_t* trailer = input + input_offset;
+    input_offset += size;
+    if (format == INFLATE_GZIP) {
+      uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+                     (uint32_t)trailer[3] << 24;
+      uint32_t length = trailer[4] | trailer[5] << 8 | trailer[6] << 16 |
+                        (uint32_t)trailer[7] << 24;
+      if (crc != checksum || length != (uint32_t)decompressed_size) {
+        return fail("Decompression error: CRC-32 mismatch");
+      }
+      return true;
+    }
+
+    uint32_t expected = (uint32_t)trailer[0] << 24 | trailer[1] << 16 |
+                        trailer[2] << 8 | trailer[3];
+    if (expected != checksum) {
+      return fail("Decompression error: Adler-32 mismatch");
+    }
+    return true;
+  }
+
+  // Decompresses the next block into the dictionary window. Returns false if
+  // there is no more output, either because the stream is done or broken.
+  bool inflateNext() {
+    if (!header_checked && !checkHeader()) {
+      return false;
+    }
+
+    while (inflate_status > TINFL_STATUS_DONE) {
+      if (input_offset == input_size && !source_finished) {
+        fillInput();
+      }
+
+      size_t in_bytes = input_size - input_offset;
+      size_t out_bytes = TINFL_LZ_DICT_SIZE - dictionary_offset;
+      mz_uint32 flags = raw ? 0 : TINFL_FLAG_PARSE_ZLIB_HEADER;
+      if (!source_finished) {
+        flags |= TINFL_FLAG_HAS_MORE_INPUT;
+      }
+
+      inflate_status = tinfl_decompress(
+          decompressor, input + input_offset, &in_bytes, dictionary,
+          dictionary + dictionary_offset, &out_bytes, flags);
+      input_offset += in_bytes;
+
+      if (inflate_status < TINFL_STATUS_DONE) {
+        Serial.printf("Decompression error: TINFL_%d\n", inflate_status);
+        status = ST_DECOMPRESSION_ERROR;
+        return false;
+      }
+
+      output_offset = dictionary_offset;
+      output_size = out_bytes;
+      dictionary_offset =
+          (dictionary_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+      decompressed_size += out_bytes;
+      if (raw) {
+        updateChecksum(dictionary + output_offset, out_bytes);
+        if (inflate_status == TINFL_STATUS_DONE && !checkTrailer()) {
+          return false;
+        }
+      }
+      if (output_size > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    while (size < length) {
+      if (output_size == 0 && !inflateNext()) {
+        break;
+      }
+
+      size_t chunk = min(length - size, output_size);
+      memcpy(buffer + size, dictionary + output_offset, chunk);
+      output_offset += chunk;
+      output_size -= chunk;
+      size += chunk;
+    }
+    return size;
+  }
+
+  // The output stays in the window until the next block is inflated
+  size_t borrowRaw(const uint8_t** data, size_t length) {
+    if (output_size == 0 && !inflateNext()) {
+      return 0;
+    }
+
+    size_t chunk = min(length, output_size);
+    *data = dictionary + output_offset;
+    output_offset += chunk;
+    output_size -= chunk;
+    return chunk;
+  }
+
+ public:
+  InflateStream(ResponseStream* source, inflate_format_t format = INFLATE_ZLIB)
+      : DecoderStream(source), format(format) {
+    decompressor =
+        (tinfl_decompressor*)buffer_malloc(sizeof(tinfl_decompressor));
+    dictionary = (uint8_t*)buffer_malloc(TINFL_LZ_DICT_SIZE);
+    tinfl_init(decompressor);
+  }
+
+  ~InflateStream() {
+    buffer_free(dictionary);
+    buffer_free(decompressor);
+  }
+
+  bool canBorrow() { return true; }
+};
+
+// Decodes the run-length codec of schema version 4 (see rle.h). Runs are
+// written directly into the buffer of the caller.
+class RleStream : public DecoderStream {
+ private:
+  // Remaining bytes of the current block
+  uint32_t literal = 0;
+  uint32_t fill = 0;
+  uint8_t value = 0;
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    while (size < length) {
+      if (fill > 0) {
+        size_t chunk = min((size_t)fill, length - size);
+        rle_fill(buffer + size, value, chunk);
+        fill -= chunk;
+        size += chunk;
+        continue;
+      }
+
+      if (input_size - input_offset < RLE_MAX_CONTROL_SIZE &&
+          !source_finished) {
+        fillInput();
+      }
+      size_t available = input_size - input_offset;
+      if (available == 0) {
+        break;
+      }
+
+      if (literal > 0) {
+        size_t chunk = min(min((size_t)literal, length - size), available);
+        memcpy(buffer + size, input + input_offset, chunk);
+        input_offset += chunk;
+        literal -= chunk;
+        size += chunk;
+        continue;
+      }
+
+      size_t used = rle_read_control(input + input_offset, available, &literal,
+                                     &fill, &value);
+      if (used == 0) {
+        Serial.println("Invalid run-length block");
+        status = ST_DECOMPRESSION_ERROR;
+        break;
+      }
+      input_offset += used;
+    }
+
+    decompressed_size += size;
+    return size;
+  }
+
+ public:
+  RleStream(ResponseStream* source) : DecoderStream(source) {}
+};
+
+// Decodes the LZ4 frame of schema version 7 (see lz4.h). The last 64 KB of
+// output are kept in a wrapping window, matches are copied from there.
+class Lz4Stream : public DecoderStream {
+ private:
+  typedef enum {
+    LZ4_FRAME_HEADER,
+    LZ4_BLOCK_HEADER,
+    LZ4_TOKEN,
+    LZ4_OFFSET,
+    LZ4_BLOCK_END,
+    LZ4_FRAME_END,
+  } lz4_state_t;
+
+  lz4_state_t state = LZ4_FRAME_HEADER;
+  uint8_t flags = 0;
+  uint8_t token = 0;
+  uint32_t block_remaining = 0;  // input bytes left in the current block
+
+  // Remaining bytes of the current sequence
+  uint32_t literal = 0;
+  uint32_t match = 0;
+  uint32_t offset = 0;
+
+  uint8_t* window;
+  uint32_t position = 0;  // total output, wraps in the window
+
+  bool fail(const char* message) {
+    Serial.println(message);
+    status = ST_DECOMPRESSION_ERROR;
+    return false;
+  }
+
+  bool readByte(uint8_t* value) {
+    if (block_remaining == 0) {
+      return fail("LZ4 sequence exceeds the block");
+    } else if (!ensureInput(1)) {
+      return false;
+    }
+    *value = input[input_offset++];
+    block_remaining--;
+    return true;
+  }
+
+  // Lengths of 15 continue with bytes that are added as long as they are 255
+  bool readLength(uint32_t* length) {
+    uint8_t extra;
+    do {
+      if (!readByte(&extra)) {
+        return false;
+      }
+      *length += extra;
+    } while (extra == 255);
+    return true;
+  }
+
+  // Parses the frame until the next literals or match. Returns false at the
+  // end of the frame or on errors.
+  bool nextSequence() {
+    while (true) {
+      switch (state) {
+        case LZ4_FRAME_HEADER: {
+          ensureInput(LZ4_MAX_FRAME_HEADER_SIZE);
+          int size = lz4_read_frame_header(
+              input + input_offset, input_size - input_offset, &flags);
+          if (size < 0) {
+            return fail("Invalid LZ4 frame header");
+          } else if (size == 0) {
+            return false;
+          }
+          input_offset += size;
+          state = LZ4_BLOCK_HEADER;
+          break;
+        }
+
+        case LZ4_BLOCK_HEADER: {
+          if (!ensureInput(4)) {
+            return false;
+          }
+          uint32_t size = lz4_read_uint32(input + input_offset);
+          input_offset += 4;
+          if (size == 0) {
+            state = LZ4_FRAME_END;
+            return false;
+          } else if (size & LZ4_BLOCK_UNCOMPRESSED) {
+            block_remaining = literal = size & ~LZ4_BLOCK_UNCOMPRESSED;
+            state = LZ4_BLOCK_END;
+            return true;
+          }
+          block_remaining = size;
+          state = LZ4_TOKEN;
+          break;
+        }
+
+        case LZ4_TOKEN: {
+          if (block_remaining == 0) {
+            state = LZ4_BLOCK_END;
+            break;
+          }
+          if (!readByte(&token)) {
+            return false;
+          }
+          literal = token >> 4;
+          if (literal == 15 && !readLength(&literal)) {
+            return false;
+          } else if (literal > block_remaining) {
+            return fail("LZ4 literals exceed the block");
+          }
+          state = LZ4_OFFSET;
+          if (literal > 0) {
+            return true;
+          }
+          break;
+        }
+
+        case LZ4_OFFSET: {
+          if (block_remaining == 0) {
+            // The last sequence of a block has no match
+            state = LZ4_BLOCK_END;
+            break;
+          }
+          uint8_t low, high;
+          if (!readByte(&low) || !readByte(&high)) {
+            return false;
+          }
+          offset = low | (high << 8);
+          match = (token & 0x0F) + LZ4_MIN_MATCH;
+          if (match == 15 + LZ4_MIN_MATCH && !readLength(&match)) {
+            return false;
+          } else if (offset == 0 || offset > position) {
+            return fail("Invalid LZ4 match offset");
+          }
+          state = LZ4_TOKEN;
+          return true;
+        }
+
+        case LZ4_BLOCK_END: {
+          if (flags & LZ4_FLAG_BLOCK_CHECKSUM) {
+            if (!ensureInput(4)) {
+              return false;
+            }
+            input_offset += 4;
+          }
+          state = LZ4_BLOCK_HEADER;
+          break;
+        }
+
+        case LZ4_FRAME_END:
+          return false;
+      }
+    }
+  }
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    while (size < length) {
+      uint32_t to = position & (LZ4_WINDOW_SIZE - 1);
+      size_t chunk = min(length - size, (size_t)LZ4_WINDOW_SIZE - to);
+      if (literal > 0) {
+        if (!ensureInput(1)) {
+          break;
+        }
+        chunk = min(min(chunk, (size_t)literal), input_size - input_offset);
+        memcpy(window + to, input + input_offset, chunk);
+        input_offset += chunk;
+        block_remaining -= chunk;
+        literal -= chunk;
+      } else if (match > 0) {
+        uint32_t from = (position - offset) & (LZ4_WINDOW_SIZE - 1);
+        chunk = min(min(chunk, (size_t)match), (size_t)LZ4_WINDOW_SIZE - from);
+        if (offset == 1) {
+          memset(window + to, window[from], chunk);
+        } else {
+          // Overlapping matches are copied in steps of the offset
+          chunk = min(chunk, (size_t)offset);
+          memmove(window + to, window + from, chunk);
+        }
+        match -= chunk;
+      } else if (nextSequence()) {
+        continue;
+      } else {
+        break;
+      }
+
+      memcpy(buffer + size, window + to, chunk);
+      position += chunk;
+      size += chunk;
+    }
+
+    decompressed_size += size;
+    return size;
+  }
+
+ public:
+  Lz4Stream(ResponseStream* source) : DecoderStream(source) {
+    window = (uint8_t*)buffer_malloc(LZ4_WINDOW_SIZE);
+  }
+
+  ~Lz4Stream() { buffer_free(window); }
+};
+
+// Hands out the payload of the IDAT chunks of a PNG file, which together form
+// the zlib stream of the image. Starts after the IHDR chunk data and reads up
+// to the end of the IEND chunk, ancillary chunks are skipped. CRCs are not
+// verified.
+class PngDataStream : public ResponseStream {
+ private:
+  ResponseStream* source;
+  uint32_t chunk_remaining = 0;
+  bool ended = false;
+
+  bool skip(uint32_t length) {
+    uint8_t scratch[64];
+    while (length > 0) {
+      uint32_t chunk = min(length, (uint32_t)sizeof(scratch));
+      if (source->readBytes(scratch, chunk) < chunk) {
+        return false;
+      }
+      length -= chunk;
+    }
+    return true;
+  }
+
+  // Moves to the data of the next IDAT chunk. Returns false at the end of the
+  // file or on errors.
+  bool nextChunk() {
+    while (true) {
+      // The CRC of the previous chunk precedes the next chunk header
+      uint8_t header[PNG_CHUNK_CRC_SIZE + PNG_CHUNK_HEADER_SIZE];
+      if (source->readBytes(header, sizeof(header)) < sizeof(header)) {
+        return false;
+      }
+      uint32_t length = png_read_uint32(header + PNG_CHUNK_CRC_SIZE);
+      uint32_t type = png_read_uint32(header + PNG_CHUNK_CRC_SIZE + 4);
+
+      if (type == PNG_CHUNK_IDAT) {
+        chunk_remaining = length;
+        if (length > 0) {
+          return true;
+        }
+      } else if (type == PNG_CHUNK_IEND) {
+        ended = skip(PNG_CHUNK_CRC_SIZE);
+        return false;
+      } else if (png_is_critical(type)) {
+        Serial.printf("Unsupported PNG chunk 0x%08x\n", type);
+        status = ST_DECOMPRESSION_ERROR;
+        return false;
+      } else if (!skip(length)) {
+        return false;
+      }
+    }
+  }
+
+ protected:
+  size_t readBytesRaw(uint8_t* buffer, size_t length) {
+    size_t size = 0;
+    while (size < length && !ended) {
+      if (chunk_remaining == 0 && !nextChunk()) {
+        break;
+      }
+
+      size_t chunk = min(length - size, (size_t)chunk_remaining);
+      size_t read = source->readBytes(buffer + size, chunk);
+      chunk_remaining -= read;
+      size += read;
+      if (read < chunk) {
+        break;
+      }
+    }
+    return size;
+  }
+
+ public:
+  PngDataStream(ResponseStream* source) : source(source) {}
+
+  // The zlib stream may end before the remaining chunks have been read
+  st_status finish() {
+    uint8_t scratch[64];
+    while (!ended && status <= ST_STREAM_END_UNEXPECTED &&
+           readBytesRaw(scratch, sizeof(scratch)) > 0) {
+    }
+    if (status > ST_STREAM_END_UNEXPECTED) {
+      return status;
+    }
+    return ended ? ST_OK : ST_STREAM_END_UNEXPECTED;
+  }
 };
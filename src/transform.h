@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Rotation and mirroring of 4 bit pixels, for panels that are not mounted in
+// landscape. The server renders rects in the orientation the panel is viewed
+// in, the device moves them to their place on the panel.
+
+// The low two bits rotate clockwise in steps of 90 degrees, TRANSFORM_MIRROR
+// flips the image horizontally before it is rotated. Build with e.g.
+// -DDISPLAY_TRANSFORM=TRANSFORM_ROTATE_90 for a panel mounted in portrait.
+typedef enum {
+  TRANSFORM_NONE = 0,
+  TRANSFORM_ROTATE_90 = 1,
+  TRANSFORM_ROTATE_180 = 2,
+  TRANSFORM_ROTATE_270 = 3,
+  TRANSFORM_MIRROR = 4,
+} transform_t;
+
+#ifndef DISPLAY_TRANSFORM
+#define DISPLAY_TRANSFORM TRANSFORM_NONE
+#endif
+
+// Rotated rects are transposed in square blocks of this many pixels, so the
+// rows of both buffers that are touched by a block stay in the cache
+#define TRANSFORM_BLOCK_SIZE 32
+
+inline int transform_degrees(int transform) { return (transform & 3) * 90; }
+
+inline bool transform_is_mirrored(int transform) {
+  return transform & TRANSFORM_MIRROR;
+}
+
+// Rotations by 90 and 270 degrees swap width and height
+inline bool transform_swaps_axes(int transform) { return transform & 1; }
+
+// Every transform is an optional transposition followed by flips of the x
+// and y axis of the result
+inline bool transform_flips_x(int transform) {
+  static const bool flip_x[8] = {false, true, true, false,
+                                 true,  true, false, false};
+  return flip_x[transform & 7];
+}
+
+inline bool transform_flips_y(int transform) {
+  static const bool flip_y[8] = {false, false, true, true,
+                                 false, true, true, false};
+  return flip_y[transform & 7];
+}
+
+// Maps the pixel x, y of an area of the given size to its transformed
+// position
+inline void transform_point(int transform, int width, int height, int x,
+                            int y, int *tx, int *ty) {
+  if (transform_swaps_axes(transform)) {
+    int swapped = x;
+    x = y;
+    y = swapped;
+    swapped = width;
+    width = height;
+    height = swapped;
+  }
+  *tx = transform_flips_x(transform) ? width - 1 - x : x;
+  *ty = transform_flips_y(transform) ? height - 1 - y : y;
+}
+
+// Maps a rect within a screen of the given size to the rect it covers after
+// the transform
+inline void transform_rect(int transform, int screen_width, int screen_height,
+                           int *x, int *y, int *width, int *height) {
+  int x0, y0, x1, y1;
+  transform_point(transform, screen_width, screen_height, *x, *y, &x0, &y0);
+  transform_point(transform, screen_width, screen_height, *x + *width - 1,
+                  *y + *height - 1, &x1, &y1);
+  *x = x0 < x1 ? x0 : x1;
+  *y = y0 < y1 ? y0 : y1;
+  *width = (x0 < x1 ? x1 - x0 : x0 - x1) + 1;
+  *height = (y0 < y1 ? y1 - y0 : y0 - y1) + 1;
+}
+
+// Reverses the order of the pixels of a row
+inline void transform_reverse_row(const uint8_t *src, uint8_t *dst,
+                                  size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    uint8_t value = src[length - 1 - i];
+    dst[i] = (value >> 4) | (value << 4);
+  }
+}
+
+// Transposes the pixels of a rect with the flips of the transform. Two
+// source rows are read a byte at a time, every pair of bytes holds a 2x2
+// block of pixels and is written as one byte to two destination rows.
+inline void transform_transpose(int transform, const uint8_t *src, int width,
+                                int height, uint8_t *dst) {
+  bool flip_x = transform_flips_x(transform);
+  bool flip_y = transform_flips_y(transform);
+  size_t src_row_size = width / 2;
+  size_t dst_row_size = height / 2;
+
+  for (int block_y = 0; block_y < height; block_y += TRANSFORM_BLOCK_SIZE) {
+    int block_bottom = block_y + TRANSFORM_BLOCK_SIZE;
+    block_bottom = block_bottom < height ? block_bottom : height;
+    for (int block_x = 0; block_x < width; block_x += TRANSFORM_BLOCK_SIZE) {
+      int block_right = block_x + TRANSFORM_BLOCK_SIZE;
+      block_right = block_right < width ? block_right : width;
+
+      for (int x = block_x; x < block_right; x += 2) {
+        // Source column x becomes destination row x
+        int row = flip_y ? width - 2 - x : x;
+        uint8_t *even = dst + (flip_y ? row + 1 : row) * dst_row_size;
+        uint8_t *odd = dst + (flip_y ? row : row + 1) * dst_row_size;
+        const uint8_t *column = src + x / 2;
+        for (int y = block_y; y < block_bottom; y += 2) {
+          uint8_t a = column[y * src_row_size];
+          uint8_t b = column[(y + 1) * src_row_size];
+          size_t i = (flip_x ? height - 2 - y : y) / 2;
+          if (flip_x) {
+            even[i] = (b & 0x0F) | (uint8_t)(a << 4);
+            odd[i] = (b >> 4) | (a & 0xF0);
+          } else {
+            even[i] = (a & 0x0F) | (uint8_t)(b << 4);
+            odd[i] = (a >> 4) | (b & 0xF0);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Writes the transformed pixels of a rect of the given size to dst, with
+// rows of the transformed width. The width must be even, as well as the
+// height if the axes are swapped.
+inline void transform_pixels(int transform, const uint8_t *src, int width,
+                             int height, uint8_t *dst) {
+  if (transform_swaps_axes(transform)) {
+    transform_transpose(transform, src, width, height, dst);
+    return;
+  }
+
+  size_t row_size = width / 2;
+  bool flip_x = transform_flips_x(transform);
+  bool flip_y = transform_flips_y(transform);
+  for (int y = 0; y < height; y++) {
+    const uint8_t *row = src + y * row_size;
+    uint8_t *target = dst + (flip_y ? height - 1 - y : y) * row_size;
+    if (flip_x) {
+      transform_reverse_row(row, target, row_size);
+    } else {
+      memcpy(target, row, row_size);
+    }
+  }
+}
@@ -0,0 +1,383 @@
+// Host benchmark for the payload codecs of the device. Decodes payload files
+// created with image-encoder.py and reports the compression ratio and the
+// decoding speed of each schema version. The codec headers it includes from
+// src must not depend on the Arduino framework, so they build on the host.
+//
+// Usage
+// g++ -O2 -pthread -I src -I lib/miniz tools/codec-benchmark.cpp lib/miniz/miniz.c -o codec-benchmark
+// ./codec-benchmark payload_v2.bin payload_v7.bin payload_v9.bin payload_v10.bin
+//
+// Version 11 is decoded with two threads, as on the two cores of the device.
+
+#include <miniz.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLE_COUNTER 1
+#endif
+
+#include "bitplane.h"
+#include "g4.h"
+#include "lz4.h"
+#include "rle.h"
+#include "scale.h"
+#include "schema.h"
+
+#define OUTPUT_SIZE 1024 * 1024
+#define ITERATIONS 50
+
+// Same as InflateStream: inflate into a wrapping 32 KB window and copy the
+// output into the destination buffer
+size_t decode_deflate(const uint8_t *src, size_t src_length, uint8_t *dst,
+                      size_t dst_length) {
+  static tinfl_decompressor decompressor;
+  static uint8_t dictionary[TINFL_LZ_DICT_SIZE];
+  tinfl_init(&decompressor);
+
+  size_t in = 0;
+  size_t out = 0;
+  size_t dictionary_offset = 0;
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  while (status > TINFL_STATUS_DONE) {
+    size_t in_bytes = src_length - in;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - dictionary_offset;
+    status = tinfl_decompress(&decompressor, src + in, &in_bytes, dictionary,
+                              dictionary + dictionary_offset, &out_bytes,
+                              TINFL_FLAG_PARSE_ZLIB_HEADER);
+    in += in_bytes;
+    if (out + out_bytes > dst_length) {
+      return 0;
+    }
+    memcpy(dst + out, dictionary + dictionary_offset, out_bytes);
+    out += out_bytes;
+    dictionary_offset =
+        (dictionary_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+  }
+  return status == TINFL_STATUS_DONE ? out : 0;
+}
+
+// Inflates the v9 payload and interleaves the rects sent as bit planes, so
+// the output is the v1 body and the ratio is comparable to version 2
+size_t decode_bit_planes(const uint8_t *src, size_t src_length, uint8_t *dst,
+                         size_t dst_length) {
+  static std::vector<uint8_t> planar(OUTPUT_SIZE);
+  static std::vector<uint32_t> row(OUTPUT_SIZE / 4);
+  size_t length = decode_deflate(src, src_length, planar.data(), planar.size());
+  if (length < 8 || length > dst_length) {
+    return 0;
+  }
+
+  // Image header
+  memcpy(dst, planar.data(), 8);
+  size_t in = 8;
+  size_t out = 8;
+  while (in + 9 <= length) {
+    const uint8_t *header = planar.data() + in;
+    int width = header[4] | header[5] << 8;
+    int height = header[6] | header[7] << 8;
+    bool bit_planes = header[8] & 1;
+    memcpy(dst + out, header, 8);
+    in += 9;
+    out += 8;
+
+    uint32_t row_size = width / 2;
+    uint32_t planes_size = BIT_PLANES * bitplane_row_size(width);
+    uint32_t in_row_size = bit_planes ? planes_size : row_size;
+    if (in + (size_t)in_row_size * height > length ||
+        out + (size_t)row_size * height > dst_length) {
+      return 0;
+    }
+    for (int y = 0; y < height; y++) {
+      if (bit_planes) {
+        bitplane_interleave_row(planar.data() + in, row.data(), width);
+        memcpy(dst + out, row.data(), row_size);
+      } else {
+        memcpy(dst + out, planar.data() + in, row_size);
+      }
+      in += in_row_size;
+      out += row_size;
+    }
+  }
+  return out;
+}
+
+// Inflates the v12 payload and expands the scaled rects, so the output is the
+// v1 body of the full resolution image
+size_t decode_scaled(const uint8_t *src, size_t src_length, uint8_t *dst,
+                     size_t dst_length) {
+  static std::vector<uint8_t> scaled(OUTPUT_SIZE);
+  size_t length = decode_deflate(src, src_length, scaled.data(), scaled.size());
+  if (length < 8 || length > dst_length) {
+    return 0;
+  }
+
+  // Image header
+  memcpy(dst, scaled.data(), 8);
+  size_t in = 8;
+  size_t out = 8;
+  while (in + 9 <= length) {
+    const uint8_t *header = scaled.data() + in;
+    int width = header[4] | header[5] << 8;
+    int height = header[6] | header[7] << 8;
+    int scale = header[8];
+    memcpy(dst + out, header, 8);
+    in += 9;
+    out += 8;
+
+    if (scale == 0 || scale > SCALE_MAX || width % (2 * scale) ||
+        height % scale) {
+      return 0;
+    }
+    uint32_t row_size = width / 2;
+    uint32_t in_row_size = row_size / scale;
+    if (in + (size_t)in_row_size * (height / scale) > length ||
+        out + (size_t)row_size * height > dst_length) {
+      return 0;
+    }
+    for (int y = 0; y < height; y += scale) {
+      scale_expand_row(scaled.data() + in, dst + out, width / scale, scale);
+      for (int repeat = 1; repeat < scale; repeat++) {
+        memcpy(dst + out + repeat * row_size, dst + out, row_size);
+      }
+      in += in_row_size;
+      out += row_size * scale;
+    }
+  }
+  return out;
+}
+
+class MemoryG4Decoder : public G4Decoder {
+ public:
+  const uint8_t *src;
+  size_t remaining;
+
+ protected:
+  size_t fill(uint8_t *buffer, size_t size) {
+    size_t length = size < remaining ? size : remaining;
+    memcpy(buffer, src, length);
+    src += length;
+    remaining -= length;
+    return length;
+  }
+};
+
+// Decodes the Group 4 rects of a v10 payload, the output is the v1 body
+size_t decode_bilevel(const uint8_t *src, size_t src_length, uint8_t *dst,
+                      size_t dst_length) {
+  static std::vector<uint16_t> reference(OUTPUT_SIZE);
+  static std::vector<uint16_t> current(OUTPUT_SIZE);
+  if (src_length < 8 || dst_length < 8) {
+    return 0;
+  }
+
+  // Image header
+  memcpy(dst, src, 8);
+  size_t in = 8;
+  size_t out = 8;
+  while (in + 13 <= src_length) {
+    const uint8_t *header = src + in;
+    int width = header[4] | header[5] << 8;
+    int height = header[6] | header[7] << 8;
+    uint8_t encoding = header[8];
+    uint32_t length = header[9] | header[10] << 8 | header[11] << 16 |
+                      (uint32_t)header[12] << 24;
+    memcpy(dst + out, header, 8);
+    in += 13;
+    out += 8;
+
+    uint32_t row_size = width / 2;
+    if (length > src_length - in ||
+        out + (size_t)row_size * height > dst_length) {
+      return 0;
+    }
+    if (encoding == RECT_ENCODING_G4) {
+      MemoryG4Decoder decoder;
+      decoder.src = src + in;
+      decoder.remaining = length;
+      decoder.begin(width, reference.data(), current.data());
+      for (int y = 0; y < height; y++) {
+        if (!decoder.decodeLine()) {
+          return 0;
+        }
+        g4_render_line(decoder.getChanges(), decoder.getChangeCount(), width,
+                       dst + out);
+        out += row_size;
+      }
+    } else {
+      memcpy(dst + out, src + in, length);
+      out += length;
+    }
+    in += length;
+  }
+  return out;
+}
+
+struct section_t {
+  const uint8_t *input;
+  size_t input_size;
+  uint8_t *output;
+  size_t output_size;
+};
+
+// Same as the device: every section is inflated straight into its place in
+// the output, every second one on another thread
+size_t decode_sections(const uint8_t *src, size_t src_length, uint8_t *dst,
+                       size_t dst_length) {
+  static std::vector<section_t> sections;
+  sections.clear();
+  if (src_length < 8 || dst_length < 8) {
+    return 0;
+  }
+
+  // Image header
+  memcpy(dst, src, 8);
+  size_t in = 8;
+  size_t out = 8;
+  while (in + 12 <= src_length) {
+    const uint8_t *header = src + in;
+    int width = header[4] | header[5] << 8;
+    int height = header[6] | header[7] << 8;
+    uint32_t length = header[8] | header[9] << 8 | header[10] << 16 |
+                      (uint32_t)header[11] << 24;
+    memcpy(dst + out, header, 8);
+    in += 12;
+    out += 8;
+
+    size_t size = (size_t)width / 2 * height;
+    if (length > src_length - in || out + size > dst_length) {
+      return 0;
+    }
+    sections.push_back({src + in, length, dst + out, size});
+    in += length;
+    out += size;
+  }
+
+  bool valid[2] = {true, true};
+  auto inflate = [&](int first) {
+    tinfl_decompressor decompressor;
+    for (size_t i = first; i < sections.size(); i += 2) {
+      const section_t &section = sections[i];
+      tinfl_init(&decompressor);
+      size_t in_bytes = section.input_size;
+      size_t out_bytes = section.output_size;
+      tinfl_status status = tinfl_decompress(
+          &decompressor, section.input, &in_bytes, section.output,
+          section.output, &out_bytes,
+          TINFL_FLAG_PARSE_ZLIB_HEADER |
+              TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+      valid[first] &=
+          status == TINFL_STATUS_DONE && out_bytes == section.output_size;
+    }
+  };
+  std::thread worker(inflate, 0);
+  inflate(1);
+  worker.join();
+  return valid[0] && valid[1] ? out : 0;
+}
+
+size_t decode_raw(const uint8_t *src, size_t src_length, uint8_t *dst,
+                  size_t dst_length) {
+  size_t length = src_length < dst_length ? src_length : dst_length;
+  memcpy(dst, src, length);
+  return length;
+}
+
+typedef size_t (*decoder_t)(const uint8_t *, size_t, uint8_t *, size_t);
+
+decoder_t get_decoder(uint8_t version) {
+  switch (version) {
+    case 1:
+      return decode_raw;
+    case 2:
+    case 3:
+      return decode_deflate;
+    case 4:
+      return rle_decode;
+    case 7:
+      return lz4_decode;
+    case 9:
+      return decode_bit_planes;
+    case 10:
+      return decode_bilevel;
+    case 11:
+      return decode_sections;
+    case 12:
+      return decode_scaled;
+    default:
+      return NULL;
+  }
+}
+
+uint64_t cycles() {
+#ifdef HAS_CYCLE_COUNTER
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+int main(int argc, char **argv) {
+  if (argc <= 1) {
+    printf("Usage: %s <payload> [<payload> ...]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> output(OUTPUT_SIZE);
+  printf("%-30s %7s %10s %10s %7s %10s %12s\n", "file", "version", "encoded",
+         "decoded", "ratio", "ns/byte", "cycles/byte");
+
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+      printf("Could not open %s\n", argv[i]);
+      return 1;
+    }
+    std::vector<uint8_t> payload;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+      payload.push_back(c);
+    }
+    fclose(file);
+
+    if (payload.empty()) {
+      printf("%s is empty\n", argv[i]);
+      continue;
+    }
+
+    uint8_t version = payload[0];
+    decoder_t decoder = get_decoder(version);
+    if (decoder == NULL) {
+      printf("%s has unknown schema version %u\n", argv[i], version);
+      continue;
+    }
+
+    size_t decoded = 0;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_cycles = cycles();
+    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+      decoded = decoder(payload.data() + 1, payload.size() - 1, output.data(),
+                        output.size());
+    }
+    uint64_t total_cycles = cycles() - start_cycles;
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+    if (decoded == 0) {
+      printf("%s could not be decoded\n", argv[i]);
+      continue;
+    }
+
+    double bytes = (double)decoded * ITERATIONS;
+    printf("%-30s %7u %10zu %10zu %6.2f%% %10.3f %12.3f\n", argv[i], version,
+           payload.size(), decoded, 100.0 * payload.size() / decoded,
+           ns / bytes, total_cycles / bytes);
+  }
+  return 0;
+}
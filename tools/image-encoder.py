@@ -2,16 +2,30 @@
 
 # Example script to encode in image into the required schema format.
 # Usage
-# python3 image-encoder.py input_image.png binary_output.bin
+# python3 image-encoder.py input_image.png binary_output.bin [version] [dictionary]
+#
+# Supported versions are 1 (raw, default), 2 (deflate), 4 (run-length),
+# 5 (tiled), 6 (palette indices), 7 (LZ4), 8 (PNG), 9 (bit planes),
+# 10 (Group 4 bilevel), 11 (sections), 12 (scaled) and 13 (transparent).
+#
+# For version 13, pixels with an alpha below 50 % are transparent.
+#
+# Versions 2, 6, 9, 12 and 13 can be compressed against a preset dictionary, e.g. the
+# uncompressed payload of a similar image. The device needs the dictionary in
+# /dict/<id> on its file system, the id is printed by this script.
 
 from PIL import Image
 import sys
+import zlib
 
 SCREEN_WIDTH = 960
 SCREEN_HEIGHT = 540
+TILE_SIZE = 32
+SECTION_ROWS = 68 # 8 sections per full screen image
+SCALE_MAX = 4
+RECT_KEY_OPAQUE = 0xFF
 
 def get_header(img: Image):
-    version = 1
     sleep_time = 6000 # 10 minutes
     x = 0
     y = 0
@@ -20,7 +34,6 @@ def get_header(img: Image):
     height = img.height
 
     return [
-        *version.to_bytes(1, "little"),
         *identifier.to_bytes(4, "little"),
         *sleep_time.to_bytes(4, "little"),
         *x.to_bytes(2, "little"),
@@ -29,6 +42,491 @@ def get_header(img: Image):
         *height.to_bytes(2, "little")
     ]
 
+def rle_encode(data: bytes):
+    # Runs of bytes where both pixels have the same gray level become fill
+    # blocks, everything else is copied in literal blocks of up to 128 bytes
+    result = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        while literal:
+            chunk = literal[:128]
+            del literal[:128]
+            result.append(len(chunk) - 1)
+            result.extend(chunk)
+
+    i = 0
+    while i < len(data):
+        byte = data[i]
+        end = i
+        if byte >> 4 == byte & 0x0F:
+            while end < len(data) and data[end] == byte:
+                end += 1
+
+        run = end - i
+        if run < 2:
+            literal.append(byte)
+            i += 1
+            continue
+
+        flush_literal()
+        if run <= 7:
+            result.append(0x80 | (run - 1) << 4 | byte & 0x0F)
+        else:
+            result.append(0xF0 | byte & 0x0F)
+            extra = run - 8
+            while extra >= 0x80:
+                result.append(extra & 0x7F | 0x80)
+                extra >>= 7
+            result.append(extra)
+        i = end
+
+    flush_literal()
+    return bytes(result)
+
+def xxh32(data: bytes, seed: int = 0):
+    # Only used for the header checksum of LZ4 frames
+    PRIME1, PRIME2, PRIME3 = 2654435761, 2246822519, 3266489917
+    PRIME4, PRIME5 = 668265263, 374761393
+    MASK = 0xFFFFFFFF
+
+    def rotl(value, bits):
+        return (value << bits | value >> (32 - bits)) & MASK
+
+    i = 0
+    if len(data) >= 16:
+        lanes = [(seed + PRIME1 + PRIME2) & MASK, (seed + PRIME2) & MASK,
+                 seed, (seed - PRIME1) & MASK]
+        while i + 16 <= len(data):
+            for lane in range(4):
+                value = int.from_bytes(data[i:i + 4], "little")
+                lanes[lane] = rotl((lanes[lane] + value * PRIME2) & MASK,
+                                   13) * PRIME1 & MASK
+                i += 4
+        result = (rotl(lanes[0], 1) + rotl(lanes[1], 7) +
+                  rotl(lanes[2], 12) + rotl(lanes[3], 18)) & MASK
+    else:
+        result = (seed + PRIME5) & MASK
+
+    result = (result + len(data)) & MASK
+    while i + 4 <= len(data):
+        value = int.from_bytes(data[i:i + 4], "little")
+        result = rotl((result + value * PRIME3) & MASK, 17) * PRIME4 & MASK
+        i += 4
+    while i < len(data):
+        result = rotl((result + data[i] * PRIME5) & MASK, 11) * PRIME1 & MASK
+        i += 1
+
+    result ^= result >> 15
+    result = result * PRIME2 & MASK
+    result ^= result >> 13
+    result = result * PRIME3 & MASK
+    result ^= result >> 16
+    return result
+
+def lz4_compress_block(data: bytes):
+    # Greedy matching with a hash table of the last position of every 4 byte
+    # sequence. The last 5 bytes are always literals and no match starts in
+    # the last 12 bytes, as required by the block format.
+    result = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    match_limit = len(data) - 12
+
+    def write_length(length):
+        while length >= 255:
+            result.append(255)
+            length -= 255
+        result.append(length)
+
+    while i < match_limit:
+        key = data[i:i + 4]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > 65535:
+            i += 1
+            continue
+
+        match = 4
+        while i + match < len(data) - 5 and \
+                data[candidate + match] == data[i + match]:
+            match += 1
+
+        literal = i - anchor
+        result.append(min(literal, 15) << 4 | min(match - 4, 15))
+        if literal >= 15:
+            write_length(literal - 15)
+        result.extend(data[anchor:i])
+        result.extend((i - candidate).to_bytes(2, "little"))
+        if match - 4 >= 15:
+            write_length(match - 4 - 15)
+
+        i += match
+        anchor = i
+
+    literal = len(data) - anchor
+    result.append(min(literal, 15) << 4)
+    if literal >= 15:
+        write_length(literal - 15)
+    result.extend(data[anchor:])
+    return bytes(result)
+
+def lz4_compress(data: bytes):
+    # LZ4 frame with independent blocks of 64 KB, readable by the lz4 tool
+    descriptor = bytes([0x60, 0x40])
+    result = bytearray((0x184D2204).to_bytes(4, "little"))
+    result.extend(descriptor)
+    result.append(xxh32(descriptor) >> 8 & 0xFF)
+    for start in range(0, len(data), 65536):
+        block = data[start:start + 65536]
+        compressed = lz4_compress_block(block)
+        if len(compressed) < len(block):
+            result.extend(len(compressed).to_bytes(4, "little"))
+            result.extend(compressed)
+        else:
+            result.extend((len(block) | 0x80000000).to_bytes(4, "little"))
+            result.extend(block)
+    result.extend(bytes(4))
+    return bytes(result)
+
+def deflate_raw(data: bytes):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return compressor.compress(data) + compressor.flush()
+
+def encode_tile(tile: bytes):
+    # Solid tiles only need the header byte, otherwise the smallest codec wins
+    if tile == bytes([tile[0]]) * len(tile) and tile[0] >> 4 == tile[0] & 0x0F:
+        return bytes([0x00 | tile[0] & 0x0F])
+
+    candidates = [bytes([0x10]) + tile]
+    for (codec, encoded) in [(0x20, rle_encode(tile)), (0x30, deflate_raw(tile))]:
+        candidates.append(bytes([codec]) + len(encoded).to_bytes(2, "little") + encoded)
+    return min(candidates, key=len)
+
+def encode_tiles(pixels: bytes, width: int, height: int):
+    row_size = width // 2
+    result = bytearray([TILE_SIZE])
+    for y in range(0, height, TILE_SIZE):
+        for x in range(0, width, TILE_SIZE):
+            tile = bytearray()
+            for row in range(y, min(y + TILE_SIZE, height)):
+                start = row * row_size + x // 2
+                tile.extend(pixels[start:start + min(TILE_SIZE, width - x) // 2])
+            result.extend(encode_tile(bytes(tile)))
+    return bytes(result)
+
+def encode_indexed(pixels: bytes, width: int, height: int):
+    # Use the smallest bit depth that can index all gray levels of the image
+    levels = sorted({byte & 0x0F for byte in pixels} | {byte >> 4 for byte in pixels})
+    bpp = 1 if len(levels) <= 2 else 2 if len(levels) <= 4 else 4
+    index = {level: i for (i, level) in enumerate(levels)}
+
+    result = bytearray([bpp, len(levels)])
+    result.extend(levels)
+    for y in range(height):
+        value = 0
+        bits = 0
+        for x in range(width):
+            byte = pixels[y * (width // 2) + x // 2]
+            level = byte >> 4 if x % 2 else byte & 0x0F
+            value |= index[level] << bits
+            bits += bpp
+            if bits == 8:
+                result.append(value)
+                value = 0
+                bits = 0
+        if bits > 0:
+            result.append(value)
+    return bytes(result)
+
+def png_filter_row(row: bytes, previous: bytes):
+    # Tries all filters and keeps the one with the smallest sum of absolute
+    # differences, the heuristic recommended by the PNG specification
+    def paeth(a, b, c):
+        p = a + b - c
+        pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+        if pa <= pb and pa <= pc:
+            return a
+        return b if pb <= pc else c
+
+    candidates = []
+    for filter_type in range(5):
+        filtered = bytearray([filter_type])
+        for i, byte in enumerate(row):
+            left = row[i - 1] if i > 0 else 0
+            up = previous[i]
+            up_left = previous[i - 1] if i > 0 else 0
+            prediction = [0, left, up, (left + up) // 2,
+                          paeth(left, up, up_left)][filter_type]
+            filtered.append((byte - prediction) & 0xFF)
+        cost = sum(b if b < 128 else 256 - b for b in filtered[1:])
+        candidates.append((cost, filtered))
+    return min(candidates, key=lambda candidate: candidate[0])[1]
+
+def encode_png(pixels: bytes, width: int, height: int):
+    # 4 bit grayscale PNG, which stores the first pixel in the high nibble
+    def chunk(chunk_type: bytes, data: bytes):
+        return len(data).to_bytes(4, "big") + chunk_type + data + \
+            zlib.crc32(chunk_type + data).to_bytes(4, "big")
+
+    row_size = width // 2
+    previous = bytes(row_size)
+    filtered = bytearray()
+    for y in range(height):
+        row = bytes((b >> 4) | (b << 4) & 0xF0
+                    for b in pixels[y * row_size:(y + 1) * row_size])
+        filtered.extend(png_filter_row(row, previous))
+        previous = row
+
+    ihdr = width.to_bytes(4, "big") + height.to_bytes(4, "big") + \
+        bytes([4, 0, 0, 0, 0])
+    return b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", ihdr) + \
+        chunk(b"IDAT", zlib.compress(bytes(filtered), 9)) + chunk(b"IEND", b"")
+
+def split_bit_planes(pixels: bytes, width: int, height: int):
+    # Every row becomes four planes, lowest bit first
+    row_size = width // 2
+    plane_size = (width + 7) // 8
+    planes = bytearray()
+    for y in range(height):
+        row = pixels[y * row_size:(y + 1) * row_size]
+        for bit in range(4):
+            plane = bytearray(plane_size)
+            for x in range(width):
+                level = row[x // 2] >> 4 if x % 2 else row[x // 2] & 0x0F
+                if level >> bit & 1:
+                    plane[x // 8] |= 1 << (x % 8)
+            planes.extend(plane)
+    return bytes(planes)
+
+def encode_bit_planes(pixels: bytes, width: int, height: int):
+    # The planes are only used if they compress better than the nibbles, e.g.
+    # for dithered images
+    planes = split_bit_planes(pixels, width, height)
+    if len(zlib.compress(planes, 9)) < len(zlib.compress(pixels, 9)):
+        return bytes([1]) + planes
+    return bytes([0]) + pixels
+
+# Run length codes of T.4 for Group 4, terminating codes for 0 to 63 followed
+# by the make up codes for multiples of 64 up to 1728
+G4_WHITE_CODES = """
+    00110101 000111 0111 1000 1011 1100 1110 1111 10011 10100 00111 01000
+    001000 000011 110100 110101 101010 101011 0100111 0001100 0001000 0010111
+    0000011 0000100 0101000 0101011 0010011 0100100 0011000 00000010 00000011
+    00011010 00011011 00010010 00010011 00010100 00010101 00010110 00010111
+    00101000 00101001 00101010 00101011 00101100 00101101 00000100 00000101
+    00001010 00001011 01010010 01010011 01010100 01010101 00100100 00100101
+    01011000 01011001 01011010 01011011 01001010 01001011 00110010 00110011
+    00110100 11011 10010 010111 0110111 00110110 00110111 01100100 01100101
+    01101000 01100111 011001100 011001101 011010010 011010011 011010100
+    011010101 011010110 011010111 011011000 011011001 011011010 011011011
+    010011000 010011001 010011010 011000 010011011
+""".split()
+
+G4_BLACK_CODES = """
+    0000110111 010 11 10 011 0011 0010 00011 000101 000100 0000100 0000101
+    0000111 00000100 00000111 000011000 0000010111 0000011000 0000001000
+    00001100111 00001101000 00001101100 00000110111 00000101000 00000010111
+    00000011000 000011001010 000011001011 000011001100 000011001101
+    000001101000 000001101001 000001101010 000001101011 000011010010
+    000011010011 000011010100 000011010101 000011010110 000011010111
+    000001101100 000001101101 000011011010 000011011011 000001010100
+    000001010101 000001010110 000001010111 000001100100 000001100101
+    000001010010 000001010011 000000100100 000000110111 000000111000
+    000000100111 000000101000 000001011000 000001011001 000000101011
+    000000101100 000001011010 000001100110 000001100111 0000001111
+    000011001000 000011001001 000001011011 000000110011 000000110100
+    000000110101 0000001101100 0000001101101 0000001001010 0000001001011
+    0000001001100 0000001001101 0000001110010 0000001110011 0000001110100
+    0000001110101 0000001110110 0000001110111 0000001010010 0000001010011
+    0000001010100 0000001010101 0000001011010 0000001011011 0000001100100
+    0000001100101
+""".split()
+
+# Make up codes from 1792 to 2560, shared by both colors
+G4_EXTENDED_CODES = """
+    00000001000 00000001100 00000001101 000000010010 000000010011
+    000000010100 000000010101 000000010110 000000010111 000000011100
+    000000011101 000000011110 000000011111
+""".split()
+
+def g4_run_codes(run: int, black: bool):
+    codes = G4_BLACK_CODES if black else G4_WHITE_CODES
+    result = ""
+    while run >= 2560:
+        result += G4_EXTENDED_CODES[-1]
+        run -= 2560
+    if run >= 1792:
+        result += G4_EXTENDED_CODES[run // 64 - 28]
+        run %= 64
+    elif run >= 64:
+        result += codes[63 + run // 64]
+        run %= 64
+    return result + codes[run]
+
+def g4_changes(line):
+    # Positions where the color changes, starting with white
+    changes = []
+    color = 0
+    for x, pixel in enumerate(line):
+        if pixel != color:
+            changes.append(x)
+            color = pixel
+    return changes
+
+def encode_g4(pixels: bytes, width: int, height: int):
+    # Group 4 (T.6) coding of the rect, gray levels below 8 become black.
+    # Returns None if the rect is not bilevel.
+    row_size = width // 2
+    levels = set(b & 0x0F for b in pixels) | set(b >> 4 for b in pixels)
+    if not levels <= {0x0, 0xF}:
+        return None
+
+    vertical = {0: "1", 1: "011", 2: "000011", 3: "0000011",
+                -1: "010", -2: "000010", -3: "0000010"}
+    bits = []
+    reference = []
+    for y in range(height):
+        row = pixels[y * row_size:(y + 1) * row_size]
+        line = []
+        for b in row:
+            line.append(1 if b & 0x0F < 8 else 0)
+            line.append(1 if b >> 4 < 8 else 0)
+        current = g4_changes(line)
+        coding = current + [width, width]
+        ref = reference + [width, width, width]
+
+        a0 = -1
+        black = False
+        while a0 < width:
+            a1 = next(c for c in coding if c > a0)
+            a2 = next(c for c in coding if c > a1) if a1 < width else width
+            k = next(k for k, c in enumerate(ref)
+                     if c > a0 and k % 2 == int(black))
+            b1, b2 = ref[k], ref[k + 1]
+            if b2 < a1:
+                bits.append("0001")
+                a0 = b2
+            elif abs(a1 - b1) <= 3:
+                bits.append(vertical[a1 - b1])
+                a0 = a1
+                black = not black
+            else:
+                bits.append("001")
+                bits.append(g4_run_codes(a1 - max(a0, 0), black))
+                bits.append(g4_run_codes(a2 - a1, not black))
+                a0 = a2
+        reference = current
+
+    # End of facsimile block, then padding to full bytes
+    bits.append("000000000001" * 2)
+    bit_string = "".join(bits)
+    bit_string += "0" * (-len(bit_string) % 8)
+    return int(bit_string, 2).to_bytes(len(bit_string) // 8, "big")
+
+def encode_bilevel(pixels: bytes, width: int, height: int):
+    # Rects that are not purely black and white are sent as nibbles
+    coded = encode_g4(pixels, width, height)
+    if coded is None:
+        return bytes([0]) + len(pixels).to_bytes(4, "little") + pixels
+    return bytes([1]) + len(coded).to_bytes(4, "little") + coded
+
+def encode_sections(pixels: bytes, x: int, y: int, width: int, height: int):
+    # Every band of rows becomes a section with its own rect header and zlib
+    # stream, so the device can inflate them in parallel
+    row_size = width // 2
+    result = bytearray()
+    for top in range(0, height, SECTION_ROWS):
+        rows = min(SECTION_ROWS, height - top)
+        data = zlib.compress(pixels[top * row_size:(top + rows) * row_size], 9)
+        result.extend(x.to_bytes(2, "little"))
+        result.extend((y + top).to_bytes(2, "little"))
+        result.extend(width.to_bytes(2, "little"))
+        result.extend(rows.to_bytes(2, "little"))
+        result.extend(len(data).to_bytes(4, "little"))
+        result.extend(data)
+    return result
+
+def downscale(pixels: bytes, width: int, height: int, scale: int):
+    # Returns the pixels at 1 / scale of the size if every block of scale by
+    # scale pixels has a single gray level, otherwise None
+    row_size = width // 2
+    def level(x, y):
+        byte = pixels[y * row_size + x // 2]
+        return byte >> 4 if x % 2 else byte & 0x0F
+
+    small = bytearray()
+    for y in range(0, height, scale):
+        byte = 0
+        for x in range(0, width, scale):
+            value = level(x, y)
+            for dy in range(scale):
+                for dx in range(scale):
+                    if level(x + dx, y + dy) != value:
+                        return None
+            if (x // scale) % 2 == 0:
+                byte = value
+            else:
+                small.append(byte | value << 4)
+    return bytes(small)
+
+def encode_scaled(pixels: bytes, width: int, height: int):
+    # The largest scale that loses no detail, e.g. for large digits or icons
+    # that were rendered at a lower resolution
+    for scale in range(SCALE_MAX, 1, -1):
+        if width % (2 * scale) == 0 and height % scale == 0:
+            small = downscale(pixels, width, height, scale)
+            if small is not None:
+                return bytes([scale]) + small
+    return bytes([1]) + pixels
+
+def encode_keyed(pixels: bytes, alpha: Image, width: int, height: int):
+    # Transparent pixels are sent as a gray level that no opaque pixel uses,
+    # which becomes the key of the rect. The rect is opaque if all levels are
+    # used.
+    if alpha is None:
+        return bytes([RECT_KEY_OPAQUE]) + pixels
+
+    row_size = width // 2
+    levels = []
+    for y in range(height):
+        for x in range(width):
+            byte = pixels[y * row_size + x // 2]
+            level = byte >> 4 if x % 2 else byte & 0x0F
+            levels.append(None if alpha.getpixel((x, y)) < 128 else level)
+
+    free = [level for level in range(16) if level not in levels]
+    if not free:
+        return bytes([RECT_KEY_OPAQUE]) + pixels
+    key = free[-1]
+    keyed = bytearray()
+    for i in range(0, len(levels), 2):
+        low = key if levels[i] is None else levels[i]
+        high = key if levels[i + 1] is None else levels[i + 1]
+        keyed.append(low | high << 4)
+    return bytes([key]) + keyed
+
+def encode_payload(version: int, payload: bytes, dictionary: bytes = None):
+    if version == 1:
+        return payload
+    if version == 2 or version == 6 or version == 9 or version == 12 or \
+            version == 13:
+        if dictionary:
+            compressor = zlib.compressobj(9, zdict=dictionary)
+            return compressor.compress(payload) + compressor.flush()
+        return zlib.compress(payload, 9)
+    if version == 4:
+        return rle_encode(payload)
+    if version == 5 or version == 8 or version == 10 or version == 11:
+        # Tiles, PNG files, Group 4 rects and sections are already encoded
+        return payload
+    if version == 7:
+        return lz4_compress(payload)
+
+    print(f"Unsupported version: {version}")
+    exit(1)
+
 def main():
     if len(sys.argv) <= 2:
         print(f"Usage: {sys.argv[0]} <input> <output>")
@@ -36,12 +534,21 @@ def main():
 
     input_image = sys.argv[1]
     output_file = sys.argv[2]
+    version = int(sys.argv[3]) if len(sys.argv) > 3 else 1
+    dictionary = None
+    if len(sys.argv) > 4:
+        with open(sys.argv[4], 'rb') as f:
+            dictionary = f.read()
+        print(f"Dictionary id: {zlib.adler32(dictionary):08x}")
 
     if SCREEN_WIDTH % 2:
         print("image width must be even!", file=sys.stderr)
         sys.exit(1)
 
     image = Image.open(input_image)
+    alpha = None
+    if version == 13 and 'A' in image.getbands():
+        alpha = image.getchannel('A')
     image = image.convert(mode='L')
     if (image.width > SCREEN_WIDTH):
         print("Image too wide!")
@@ -55,6 +562,7 @@ def main():
     with open(output_file, 'wb') as f:
         result = []
         result.extend(get_header(image))
+        pixels = []
 
         for y in range(0, image.size[1]):
             byte = 0
@@ -64,10 +572,38 @@ def main():
                     byte = color >> 4
                 else:
                     byte |= color & 0xF0
-                    result.append(byte)
+                    pixels.append(byte)
+
+        if version == 5:
+            result.extend(encode_tiles(bytes(pixels), image.width, image.height))
+        elif version == 6:
+            result.extend(encode_indexed(bytes(pixels), image.width, image.height))
+        elif version == 8:
+            result.extend(encode_png(bytes(pixels), image.width, image.height))
+        elif version == 9:
+            result.extend(encode_bit_planes(bytes(pixels), image.width,
+                                            image.height))
+        elif version == 10:
+            result.extend(encode_bilevel(bytes(pixels), image.width,
+                                         image.height))
+        elif version == 12:
+            result.extend(encode_scaled(bytes(pixels), image.width,
+                                        image.height))
+        elif version == 13:
+            result.extend(encode_keyed(bytes(pixels), alpha, image.width,
+                                       image.height))
+        elif version == 11:
+            # The sections replace the rect header
+            del result[8:]
+            result.extend(encode_sections(bytes(pixels), 0, 0, image.width,
+                                          image.height))
+        else:
+            result.extend(pixels)
 
-        f.write(bytes(result))
-        print(f"Finished writing {len(result)} bytes to {output_file}")
+        payload = bytes([version]) + encode_payload(version, bytes(result),
+                                                    dictionary)
+        f.write(payload)
+        print(f"Finished writing {len(payload)} bytes to {output_file}")
 
 if __name__ == "__main__":
     main()
\ No newline at end of file